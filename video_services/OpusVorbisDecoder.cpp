@@ -23,6 +23,7 @@
 */
 
 #include "OpusVorbisDecoder.hpp"
+#include "PCMConvert.hpp"
 
 #include <vorbis/codec.h>
 #include <opus/opus.h>
@@ -43,7 +44,10 @@ struct VorbisDecoder
 
 OpusVorbisDecoder::OpusVorbisDecoder(const WebMDemuxer &demuxer) :
 	m_vorbis(NULL), m_opus(NULL),
-	m_numSamples(0)
+	m_numSamples(0),
+	m_sampleRate(demuxer.getSampleRate()),
+	m_preSkip(0),
+	m_skipSamples(0)
 {
 	switch (demuxer.getAudioCodec())
 	{
@@ -76,53 +80,106 @@ bool OpusVorbisDecoder::getPCMS16(WebMFrame &frame, short *buffer, int &numOutSa
 {
 	if (m_vorbis)
 	{
-		m_vorbis->op.packet = frame.buffer;
-		m_vorbis->op.bytes = frame.bufferSize;
-
-		if (vorbis_synthesis(&m_vorbis->block, &m_vorbis->op))
+		if (!synthesizeVorbis(frame))
 			return false;
-		if (vorbis_synthesis_blockin(&m_vorbis->dspState, &m_vorbis->block))
+		numOutSamples = readVorbis(buffer, false);
+	}
+	else if (m_opus)
+	{
+		const int samples = opus_decode(m_opus, frame.buffer, frame.bufferSize, buffer, m_numSamples, 0);
+		if (samples < 0)
+			return false;
+		numOutSamples = samples;
+	}
+	else
+		return false;
+	trimSamples(frame, buffer, sizeof(short), numOutSamples);
+	return true;
+}
+bool OpusVorbisDecoder::getPCMF32(WebMFrame &frame, float *buffer, int &numOutSamples)
+{
+	if (m_vorbis)
+	{
+		if (!synthesizeVorbis(frame))
 			return false;
+		numOutSamples = readVorbis(buffer, true);
+	}
+	else if (m_opus)
+	{
+		const int samples = opus_decode_float(m_opus, frame.buffer, frame.bufferSize, buffer, m_numSamples, 0);
+		if (samples < 0)
+			return false;
+		numOutSamples = samples;
+	}
+	else
+		return false;
+	trimSamples(frame, buffer, sizeof(float), numOutSamples);
+	return true;
+}
+
+void OpusVorbisDecoder::reset()
+{
+	if (m_vorbis)
+		vorbis_synthesis_restart(&m_vorbis->dspState);
+	else if (m_opus)
+		opus_decoder_ctl(m_opus, OPUS_RESET_STATE);
+	m_skipSamples = 0;
+}
+void OpusVorbisDecoder::restart()
+{
+	reset();
+	m_skipSamples = m_preSkip;
+}
+
+bool OpusVorbisDecoder::synthesizeVorbis(WebMFrame &frame)
+{
+	m_vorbis->op.packet = (unsigned char *)frame.buffer;
+	m_vorbis->op.bytes = frame.bufferSize;
+
+	if (vorbis_synthesis(&m_vorbis->block, &m_vorbis->op))
+		return false;
+	if (vorbis_synthesis_blockin(&m_vorbis->dspState, &m_vorbis->block))
+		return false;
+	return true;
+}
+int OpusVorbisDecoder::readVorbis(void *buffer, bool asFloat)
+{
+	const int maxSamples = getBufferSamples();
+	int samplesCount, count = 0;
+	float **pcm;
+	samplesCount = vorbis_synthesis_pcmout( &m_vorbis->dspState, &pcm );
+	while ( samplesCount && count < maxSamples )
+	{
+		//Whatever doesn't fit is left in the decoder for the next packet
+		const int space = maxSamples - count;
+		const int toConvert = samplesCount <= space ? samplesCount : space;
+		if (asFloat)
+			interleaveFloat(pcm, m_channels, toConvert, (float *)buffer + count * m_channels);
+		else
+			floatToS16(pcm, m_channels, toConvert, (short *)buffer + count * m_channels);
+		vorbis_synthesis_read(&m_vorbis->dspState, toConvert);
+		count += toConvert;
 
-		const int maxSamples = getBufferSamples();
-		int samplesCount, count = 0;
-		float **pcm;
 		samplesCount = vorbis_synthesis_pcmout( &m_vorbis->dspState, &pcm );
-		while ( samplesCount )
-		{
-			const int toConvert = samplesCount <= maxSamples ? samplesCount : maxSamples;
-			for (int c = 0; c < m_channels; ++c)
-			{
-				float *samples = pcm[c];
-				for (int i = 0, j = c; i < toConvert; ++i, j += m_channels)
-				{
-					int sample = (int)(samples[i] * 32767.0f);
-					if (sample > 32767)
-						sample = 32767;
-					else if (sample < -32768)
-						sample = -32768;
-					buffer[count + j] = sample;
-				}
-			}
-			vorbis_synthesis_read(&m_vorbis->dspState, toConvert);
-			count += toConvert;
-
-			samplesCount = vorbis_synthesis_pcmout( &m_vorbis->dspState, &pcm );
-		}
+	}
+	return count;
+}
 
-		numOutSamples = count;
-		return true;
+void OpusVorbisDecoder::trimSamples(const WebMFrame &frame, void *buffer, int sampleSize, int &numOutSamples)
+{
+	if (frame.discardPadding > 0.0)
+	{
+		const int padding = (int)(frame.discardPadding * m_sampleRate + 0.5);
+		numOutSamples = padding < numOutSamples ? numOutSamples - padding : 0;
 	}
-	else if (m_opus)
+	if (m_skipSamples > 0)
 	{
-		const int samples = opus_decode(m_opus, frame.buffer, frame.bufferSize, buffer, m_numSamples, 0);
-		if (samples >= 0)
-		{
-			numOutSamples = samples;
-			return true;
-		}
+		const int skip = m_skipSamples < numOutSamples ? m_skipSamples : numOutSamples;
+		const int frameSize = m_channels * sampleSize;
+		memmove(buffer, (unsigned char *)buffer + skip * frameSize, (numOutSamples - skip) * frameSize);
+		numOutSamples -= skip;
+		m_skipSamples -= skip;
 	}
-	return false;
 }
 
 bool OpusVorbisDecoder::openVorbis(const WebMDemuxer &demuxer)
@@ -207,6 +264,13 @@ bool OpusVorbisDecoder::openOpus(const WebMDemuxer &demuxer)
 	if (!opusErr)
 	{
 		m_numSamples = demuxer.getSampleRate() * 0.06 + 0.5; //Maximum frame size (for 60 ms frame)
+
+		//Pre-skip from the OpusHead, always counted at 48 kHz
+		size_t extradataSize = 0;
+		const unsigned char *extradata = demuxer.getAudioExtradata(extradataSize);
+		if (extradata && extradataSize >= 19 && !memcmp(extradata, "OpusHead", 8))
+			m_preSkip = (int)((extradata[10] | (extradata[11] << 8)) * (double)demuxer.getSampleRate() / 48000.0 + 0.5);
+		m_skipSamples = m_preSkip;
 		return true;
 	}
 	return false;
@@ -49,17 +49,30 @@ public:
 	}
 
 	bool getPCMS16(WebMFrame &frame, short *buffer, int &numOutSamples);
+	//Interleaved float straight from the decoder, for devices that mix in float anyway
+	bool getPCMF32(WebMFrame &frame, float *buffer, int &numOutSamples);
+
+	//Drops any decoder state, for after a seek
+	void reset();
+	//Drops any decoder state and skips the codec's priming samples again, for going back to the start of the stream
+	void restart();
 
 private:
 	bool openVorbis(const WebMDemuxer &demuxer);
 	bool openOpus(const WebMDemuxer &demuxer);
 
 	void close();
+	bool synthesizeVorbis(WebMFrame &frame);
+	int readVorbis(void *buffer, bool asFloat);
+	void trimSamples(const WebMFrame &frame, void *buffer, int sampleSize, int &numOutSamples);
 
 	VorbisDecoder *m_vorbis;
 	OpusDecoder *m_opus;
 	int m_numSamples;
 	int m_channels;
+	int m_sampleRate;
+	int m_preSkip; //Opus priming samples at the start of the stream
+	int m_skipSamples; //Still to drop
 
 };
 
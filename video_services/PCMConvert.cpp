@@ -0,0 +1,141 @@
+#include "PCMConvert.hpp"
+
+#include "tier0/platform.h"
+
+#include <string.h>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+	#define PCMCONVERT_SSE2
+	#include <emmintrin.h>
+#endif
+
+void floatToS16Scalar(float **planes, int channels, int first, int count, short *out)
+{
+	for (int c = 0; c < channels; ++c)
+	{
+		const float *samples = planes[c];
+		for (int i = first, j = first * channels + c; i < count; ++i, j += channels)
+		{
+			int sample = (int)(samples[i] * 32767.0f);
+			if (sample > 32767)
+				sample = 32767;
+			else if (sample < -32768)
+				sample = -32768;
+			out[j] = sample;
+		}
+	}
+}
+
+#ifdef PCMCONVERT_SSE2
+//Eight samples to S16, clamped before truncating so the result matches the scalar conversion exactly
+static inline __m128i floatToS16x8(const float *samples)
+{
+	const __m128 scale = _mm_set1_ps(32767.0f);
+	const __m128 minimum = _mm_set1_ps(-32768.0f);
+	const __m128 maximum = _mm_set1_ps(32767.0f);
+	const __m128 a = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(samples), scale), minimum), maximum);
+	const __m128 b = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(samples + 4), scale), minimum), maximum);
+	return _mm_packs_epi32(_mm_cvttps_epi32(a), _mm_cvttps_epi32(b));
+}
+
+//Four interleaved sample pairs, each one frame apart
+static inline void storePairs(__m128i pairs, short *out, int channels)
+{
+	for (int k = 0; k < 4; ++k, out += channels)
+	{
+		const int pair = _mm_cvtsi128_si32(pairs);
+		memcpy(out, &pair, sizeof pair);
+		pairs = _mm_srli_si128(pairs, 4);
+	}
+}
+
+int floatToS16SSE2(float **planes, int channels, int count, short *out)
+{
+	const int blocks = count & ~7;
+	if (channels == 1)
+	{
+		for (int i = 0; i < blocks; i += 8)
+			_mm_storeu_si128((__m128i *)(out + i), floatToS16x8(planes[0] + i));
+	}
+	else if (channels == 2)
+	{
+		for (int i = 0; i < blocks; i += 8)
+		{
+			const __m128i left = floatToS16x8(planes[0] + i);
+			const __m128i right = floatToS16x8(planes[1] + i);
+			_mm_storeu_si128((__m128i *)(out + i * 2), _mm_unpacklo_epi16(left, right));
+			_mm_storeu_si128((__m128i *)(out + i * 2 + 8), _mm_unpackhi_epi16(left, right));
+		}
+	}
+	else
+	{
+		//Channels two at a time, so every store puts down a pair of them
+		for (int i = 0; i < blocks; i += 8)
+		{
+			short *frame = out + i * channels;
+			int c = 0;
+			for (; c + 1 < channels; c += 2)
+			{
+				const __m128i first = floatToS16x8(planes[c] + i);
+				const __m128i second = floatToS16x8(planes[c + 1] + i);
+				storePairs(_mm_unpacklo_epi16(first, second), frame + c, channels);
+				storePairs(_mm_unpackhi_epi16(first, second), frame + 4 * channels + c, channels);
+			}
+			if (c < channels)
+			{
+				short last[8];
+				_mm_storeu_si128((__m128i *)last, floatToS16x8(planes[c] + i));
+				for (int k = 0; k < 8; ++k)
+					frame[k * channels + c] = last[k];
+			}
+		}
+	}
+	return blocks;
+}
+#else
+int floatToS16SSE2(float **planes, int channels, int count, short *out)
+{
+	return 0;
+}
+#endif
+
+void interleaveFloat(float **planes, int channels, int count, float *out)
+{
+	int converted = 0;
+	if (channels == 1)
+	{
+		memcpy(out, planes[0], count * sizeof(float));
+		return;
+	}
+#ifdef PCMCONVERT_SSE2
+	if (channels == 2)
+	{
+		//SSE is all this takes, which every x86 the engine runs on has
+		converted = count & ~3;
+		for (int i = 0; i < converted; i += 4)
+		{
+			const __m128 left = _mm_loadu_ps(planes[0] + i);
+			const __m128 right = _mm_loadu_ps(planes[1] + i);
+			_mm_storeu_ps(out + i * 2, _mm_unpacklo_ps(left, right));
+			_mm_storeu_ps(out + i * 2 + 4, _mm_unpackhi_ps(left, right));
+		}
+	}
+#endif
+	for (int c = 0; c < channels; ++c)
+	{
+		const float *samples = planes[c];
+		for (int i = converted, j = converted * channels + c; i < count; ++i, j += channels)
+			out[j] = samples[i];
+	}
+}
+
+void floatToS16(float **planes, int channels, int count, short *out)
+{
+	int converted = 0;
+#ifdef PCMCONVERT_SSE2
+	static const bool hasSSE2 = GetCPUInformation()->m_bSSE2;
+	if (hasSSE2)
+		converted = floatToS16SSE2(planes, channels, count, out);
+#endif
+	floatToS16Scalar(planes, channels, converted, count, out);
+}
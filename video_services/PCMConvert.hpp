@@ -0,0 +1,20 @@
+#ifndef PCMCONVERT_HPP
+#define PCMCONVERT_HPP
+#if defined( _WIN32 )
+#pragma once
+#endif
+
+//Decoders give planar float, one plane per channel, and these interleave it for the sound device
+
+//Planar float to interleaved S16 with saturation, with SSE2 where the CPU has it
+void floatToS16(float **planes, int channels, int count, short *out);
+//Planar float to interleaved float, as it is
+void interleaveFloat(float **planes, int channels, int count, float *out);
+
+//The plain loop floatToS16 has to match, converting from sample first up to count
+void floatToS16Scalar(float **planes, int channels, int first, int count, short *out);
+//The SSE2 kernels on their own, returns how many samples from each plane were converted.
+//Always a multiple of 8, and 0 where SSE2 isn't compiled in
+int floatToS16SSE2(float **planes, int channels, int count, short *out);
+
+#endif // PCMCONVERT_HPP
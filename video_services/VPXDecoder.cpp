@@ -25,15 +25,37 @@
 #include "VPXDecoder.hpp"
 
 #include <vpx/vpx_decoder.h>
+#include <vpx/vpx_frame_buffer.h>
 #include <vpx/vp8dx.h>
 
+#include "tier0/threadtools.h"
+
 #include <stdlib.h>
 #include <string.h>
 
-VPXDecoder::VPXDecoder(const WebMDemuxer &demuxer, unsigned threads) :
+struct VPXDecoder::FrameBuffer
+{
+	unsigned char *data;
+	size_t size;
+	int refs; //libvpx's and the caller's
+};
+
+//Fixed set of buffers libvpx decodes into, recycled once nothing references them.
+//libvpx and callers can hold references from different threads so it's locked
+struct VPXDecoder::FramePool
+{
+	FrameBuffer *buffers;
+	int count;
+	CThreadFastMutex mutex;
+};
+
+VPXDecoder::VPXDecoder(const WebMDemuxer &demuxer, unsigned threads, THREAD_MODE threadMode, unsigned heldFrames) :
 	m_ctx(NULL),
+	m_pool(NULL),
+	m_codec(demuxer.getVideoCodec()),
 	m_iter(NULL),
 	m_delay(0),
+	m_decodeCount(0),
 	m_last_space(VPX_CS_UNKNOWN)
 {
 	if (threads > 8)
@@ -55,7 +77,8 @@ VPXDecoder::VPXDecoder(const WebMDemuxer &demuxer, unsigned threads) :
 			break;
 		case WebMDemuxer::VIDEO_VP9:
 			codecIface = vpx_codec_vp9_dx();
-			m_delay = threads - 1;
+			if (threadMode == THREAD_FRAMES)
+				m_delay = threads - 1;
 			break;
 		default:
 			return;
@@ -66,6 +89,25 @@ VPXDecoder::VPXDecoder(const WebMDemuxer &demuxer, unsigned threads) :
 	{
 		delete m_ctx;
 		m_ctx = NULL;
+		return;
+	}
+
+	if (threadMode == THREAD_ROWS && m_codec == WebMDemuxer::VIDEO_VP9)
+		vpx_codec_control(m_ctx, VP9D_SET_ROW_MT, 1);
+
+	//Decode into our own buffers so images can be held onto, only VP9 supports this.
+	//Frames in flight with frame threading hold buffers too
+	if (vpx_codec_get_caps(codecIface) & VPX_CODEC_CAP_EXTERNAL_FRAME_BUFFER)
+	{
+		m_pool = new FramePool;
+		m_pool->count = VP9_MAXIMUM_REF_BUFFERS + VPX_MAXIMUM_WORK_BUFFERS + heldFrames + m_delay;
+		m_pool->buffers = (FrameBuffer *)calloc(m_pool->count, sizeof(FrameBuffer));
+		if (vpx_codec_set_frame_buffer_functions(m_ctx, getFrameBuffer, releaseFrameBuffer, m_pool))
+		{
+			free(m_pool->buffers);
+			delete m_pool;
+			m_pool = NULL;
+		}
 	}
 }
 VPXDecoder::~VPXDecoder()
@@ -75,12 +117,40 @@ VPXDecoder::~VPXDecoder()
 		vpx_codec_destroy(m_ctx);
 		delete m_ctx;
 	}
+	if (m_pool)
+	{
+		for (int i = 0; i < m_pool->count; ++i)
+			free(m_pool->buffers[i].data);
+		free(m_pool->buffers);
+		delete m_pool;
+	}
 }
 
 bool VPXDecoder::decode(const WebMFrame &frame)
 {
 	m_iter = NULL;
-	return !vpx_codec_decode(m_ctx, frame.buffer, frame.bufferSize, NULL, 0);
+	//Never more than m_delay + 1 in flight, threads are capped at 8 so the ring can't wrap onto a live entry
+	const unsigned index = m_decodeCount++;
+	m_times[index % (sizeof(m_times) / sizeof(m_times[0]))] = frame.time;
+	return !vpx_codec_decode(m_ctx, frame.buffer, frame.bufferSize, (void *)(size_t)index, 0);
+}
+bool VPXDecoder::flush()
+{
+	m_iter = NULL;
+	return !vpx_codec_decode(m_ctx, NULL, 0, NULL, 0);
+}
+void VPXDecoder::reset()
+{
+	if (!m_ctx)
+		return;
+
+	//Nothing from the last stream may come out of the next one, libvpx's references go with its next keyframe
+	if (flush())
+		while (vpx_codec_get_frame(m_ctx, &m_iter))
+			;
+	m_iter = NULL;
+	m_decodeCount = 0;
+	m_last_space = VPX_CS_UNKNOWN;
 }
 VPXDecoder::IMAGE_ERROR VPXDecoder::getImage(Image &image)
 {
@@ -113,6 +183,9 @@ VPXDecoder::IMAGE_ERROR VPXDecoder::getImage(Image &image)
 				image.linesize[1] = img->stride[uPlane];
 				image.linesize[2] = img->stride[vPlane];
 
+				image.buffer = m_pool ? (FrameBuffer *)img->fb_priv : NULL;
+				image.time = m_times[(size_t)img->user_priv % (sizeof(m_times) / sizeof(m_times[0]))];
+
 				err = NO_IMAGE_ERROR;
 			}
 		}
@@ -124,8 +197,560 @@ VPXDecoder::IMAGE_ERROR VPXDecoder::getImage(Image &image)
 	return err;
 }
 
+bool VPXDecoder::retainImage(const Image &image)
+{
+	if (!m_pool || !image.buffer)
+		return false;
+
+	m_pool->mutex.Lock();
+	++image.buffer->refs;
+	m_pool->mutex.Unlock();
+	return true;
+}
+void VPXDecoder::releaseImage(const Image &image)
+{
+	if (!m_pool || !image.buffer)
+		return;
+
+	m_pool->mutex.Lock();
+	--image.buffer->refs;
+	m_pool->mutex.Unlock();
+}
+
+int VPXDecoder::getFrameBuffer(void *priv, size_t minSize, vpx_codec_frame_buffer *fb)
+{
+	FramePool *pool = (FramePool *)priv;
+	FrameBuffer *buffer = NULL;
+
+	pool->mutex.Lock();
+	//Prefer a free buffer that's already big enough
+	for (int i = 0; i < pool->count; ++i)
+	{
+		FrameBuffer &candidate = pool->buffers[i];
+		if (candidate.refs > 0)
+			continue;
+		if (!buffer || (candidate.size >= minSize && buffer->size < minSize))
+			buffer = &candidate;
+		if (buffer->size >= minSize)
+			break;
+	}
+	if (buffer)
+		buffer->refs = 1;
+	pool->mutex.Unlock();
+
+	//Everything's held, the pool is bounded by how many frames the caller holds onto
+	if (!buffer)
+		return -1;
+
+	if (buffer->size < minSize)
+	{
+		//libvpx wants new buffers zeroed
+		free(buffer->data);
+		buffer->data = (unsigned char *)calloc(1, minSize);
+		buffer->size = buffer->data ? minSize : 0;
+		if (!buffer->data)
+		{
+			pool->mutex.Lock();
+			buffer->refs = 0;
+			pool->mutex.Unlock();
+			return -1;
+		}
+	}
+
+	fb->data = buffer->data;
+	fb->size = buffer->size;
+	fb->priv = buffer;
+	return 0;
+}
+int VPXDecoder::releaseFrameBuffer(void *priv, vpx_codec_frame_buffer *fb)
+{
+	FramePool *pool = (FramePool *)priv;
+	FrameBuffer *buffer = (FrameBuffer *)fb->priv;
+	if (!buffer)
+		return -1;
+
+	pool->mutex.Lock();
+	--buffer->refs;
+	pool->mutex.Unlock();
+	return 0;
+}
+
 /**/
 
+namespace {
+
+//MSB first bit reader for the VP9 uncompressed header
+class BitReader
+{
+public:
+	BitReader(const unsigned char *data, size_t size) :
+		m_data(data), m_size(size), m_bit(0)
+	{}
+
+	inline bool overrun() const
+	{
+		return m_bit > m_size * 8;
+	}
+	int readBit()
+	{
+		const size_t bit = m_bit++;
+		if (bit >= m_size * 8)
+			return 0;
+		return (m_data[bit >> 3] >> (7 - (bit & 7))) & 1;
+	}
+	int readLiteral(int bits)
+	{
+		int value = 0;
+		while (bits--)
+			value = (value << 1) | readBit();
+		return value;
+	}
+
+private:
+	const unsigned char *m_data;
+	size_t m_size;
+	size_t m_bit;
+};
+
+//VP8's boolean entropy decoder, RFC 6386 section 7
+class BoolDecoder
+{
+public:
+	BoolDecoder(const unsigned char *data, size_t size) :
+		m_data(data), m_end(data + size),
+		m_range(255), m_value(0), m_bitCount(0)
+	{
+		m_value = (nextByte() << 8);
+		m_value |= nextByte();
+	}
+
+	int readBool(int prob)
+	{
+		const unsigned int split = 1 + (((m_range - 1) * prob) >> 8);
+		const unsigned int bigSplit = split << 8;
+		int ret;
+		if (m_value >= bigSplit)
+		{
+			ret = 1;
+			m_range -= split;
+			m_value -= bigSplit;
+		}
+		else
+		{
+			ret = 0;
+			m_range = split;
+		}
+		while (m_range < 128)
+		{
+			m_value <<= 1;
+			m_range <<= 1;
+			if (++m_bitCount == 8)
+			{
+				m_bitCount = 0;
+				m_value |= nextByte();
+			}
+		}
+		return ret;
+	}
+	int readFlag()
+	{
+		return readBool(128);
+	}
+	int readLiteral(int bits)
+	{
+		int value = 0;
+		while (bits--)
+			value = (value << 1) | readFlag();
+		return value;
+	}
+	//Optional signed value, only the flag matters for getting past it
+	void skipOptionalSigned(int bits)
+	{
+		if (readFlag())
+			readLiteral(bits + 1);
+	}
+
+private:
+	inline unsigned int nextByte()
+	{
+		return m_data < m_end ? *m_data++ : 0;
+	}
+
+	const unsigned char *m_data, *m_end;
+	unsigned int m_range, m_value;
+	int m_bitCount;
+};
+
+//True if the frame is a keyframe, intra only or error resilient, none of which take motion vectors
+//from the frame decoded before them
+bool isVP9PrevMvsReset(const unsigned char *data, size_t size)
+{
+	BitReader br(data, size);
+	if (br.readLiteral(2) != 2) //Frame marker
+		return false;
+	const int profileLow = br.readBit();
+	const int profile = profileLow | (br.readBit() << 1);
+	if (profile == 3)
+		br.readBit();
+
+	if (br.readBit()) //show_existing_frame
+		return false;
+
+	const int keyFrame = !br.readBit();
+	const int showFrame = br.readBit();
+	const int errorResilient = br.readBit();
+	if (keyFrame || errorResilient)
+		return !br.overrun();
+	return !showFrame && br.readBit() && !br.overrun(); //intra_only
+}
+
+bool isDroppableVP9Frame(const unsigned char *data, size_t size)
+{
+	BitReader br(data, size);
+	if (br.readLiteral(2) != 2) //Frame marker
+		return false;
+	const int profileLow = br.readBit();
+	const int profile = profileLow | (br.readBit() << 1);
+	if (profile == 3)
+		br.readBit();
+
+	//Costs nothing to decode, and depending on the libvpx version it can change whether the
+	//next frame uses the previous frame's motion vectors
+	if (br.readBit())
+		return false;
+
+	const int keyFrame = !br.readBit();
+	const int showFrame = br.readBit();
+	const int errorResilient = br.readBit();
+	//Error resilient frames reset all four saved frame contexts
+	if (keyFrame || errorResilient)
+		return false;
+
+	//Intra only frames are rare, not worth parsing the rest of
+	const int intraOnly = showFrame ? 0 : br.readBit();
+	if (intraOnly)
+		return false;
+	if (br.readLiteral(2)) //reset_frame_context
+		return false;
+
+	if (br.readLiteral(8)) //refresh_frame_flags
+		return false;
+
+	br.readLiteral(3 * (3 + 1)); //ref_frame_idx and sign bias for each reference
+	bool foundRef = false;
+	for (int i = 0; i < 3 && !foundRef; ++i)
+		foundRef = br.readBit();
+	if (!foundRef)
+		br.readLiteral(16 + 16);
+	if (br.readBit()) //render_and_frame_size_different
+		br.readLiteral(16 + 16);
+	br.readBit(); //allow_high_precision_mv
+	if (!br.readBit()) //is_filter_switchable
+		br.readLiteral(2);
+
+	//Saving its probabilities for later frames counts as being referenced
+	if (br.readBit()) //refresh_frame_context
+		return false;
+	br.readBit(); //frame_parallel_decoding_mode
+	br.readLiteral(2); //frame_context_idx
+
+	//Loop filter deltas carry over to later frames until they're updated again
+	br.readLiteral(6 + 3); //filter_level, sharpness
+	if (br.readBit() && br.readBit()) //mode_ref_delta_enabled, mode_ref_delta_update
+		return false;
+
+	br.readLiteral(8); //base_q_idx
+	for (int i = 0; i < 3; ++i)
+	{
+		if (br.readBit()) //delta_coded
+			br.readLiteral(4 + 1);
+	}
+
+	//So do segmentation parameters, and the segment map is predicted from the last frame's
+	if (br.readBit()) //segmentation_enabled
+		return false;
+
+	return !br.overrun();
+}
+
+bool isDroppableVP8Frame(const unsigned char *data, size_t size)
+{
+	if (size < 3)
+		return false;
+
+	const unsigned int tag = data[0] | (data[1] << 8) | (data[2] << 16);
+	const bool keyFrame = !(tag & 1);
+	const size_t firstPartitionSize = (tag >> 5) & 0x7FFFF;
+	if (keyFrame || 3 + firstPartitionSize > size)
+		return false;
+
+	BoolDecoder bd(data + 3, firstPartitionSize);
+
+	//The segment map and feature data are kept for later frames, so updating either counts as being referenced
+	if (bd.readFlag()) //segmentation_enabled
+	{
+		if (bd.readFlag() || bd.readFlag()) //update_mb_segmentation_map, update_segment_feature_data
+			return false;
+	}
+
+	//As do the loop filter deltas
+	bd.readLiteral(1 + 6 + 3); //filter_type, loop_filter_level, sharpness_level
+	if (bd.readFlag() && bd.readFlag()) //loop_filter_adj_enable, mode_ref_lf_delta_update
+		return false;
+
+	bd.readLiteral(2); //log2_nbr_of_dct_partitions
+	bd.readLiteral(7); //y_ac_qi
+	for (int i = 0; i < 5; ++i)
+		bd.skipOptionalSigned(4);
+
+	const int refreshGolden = bd.readFlag();
+	const int refreshAlt = bd.readFlag();
+	const int copyToGolden = refreshGolden ? 0 : bd.readLiteral(2);
+	const int copyToAlt = refreshAlt ? 0 : bd.readLiteral(2);
+	bd.readLiteral(2); //Sign bias for golden and alt
+	const int refreshEntropyProbs = bd.readFlag();
+	const int refreshLast = bd.readFlag();
+
+	return !refreshGolden && !refreshAlt && !copyToGolden && !copyToAlt && !refreshEntropyProbs && !refreshLast;
+}
+
+bool getVP9StreamInfo(const unsigned char *data, size_t size, VPXDecoder::StreamInfo &info)
+{
+	BitReader br(data, size);
+	if (br.readLiteral(2) != 2) //Frame marker
+		return false;
+	const int profileLow = br.readBit();
+	const int profile = profileLow | (br.readBit() << 1);
+	if (profile == 3)
+		br.readBit();
+
+	if (br.readBit()) //show_existing_frame
+		return false;
+	if (br.readBit()) //Not a keyframe
+		return false;
+	br.readBit(); //show_frame
+	const int errorResilient = br.readBit();
+	if (br.readLiteral(24) != 0x498342) //Sync code
+		return false;
+
+	//Colour config
+	if (profile >= 2)
+		br.readBit(); //ten_or_twelve_bit
+	if (br.readLiteral(3) != 7) //Anything but sRGB
+	{
+		br.readBit(); //color_range
+		if (profile == 1 || profile == 3)
+			br.readLiteral(3); //Subsampling and a reserved bit
+	}
+	else if (profile == 1 || profile == 3)
+	{
+		br.readBit();
+	}
+
+	info.width = br.readLiteral(16) + 1;
+	info.height = br.readLiteral(16) + 1;
+	if (br.readBit()) //render_and_frame_size_different
+		br.readLiteral(16 + 16);
+
+	info.frameParallel = true;
+	if (!errorResilient)
+	{
+		br.readBit(); //refresh_frame_context
+		info.frameParallel = br.readBit() != 0;
+	}
+	br.readLiteral(2); //frame_context_idx
+
+	//Loop filter
+	br.readLiteral(6 + 3);
+	if (br.readBit() && br.readBit()) //mode_ref_delta_enabled, mode_ref_delta_update
+	{
+		for (int i = 0; i < 4 + 2; ++i)
+		{
+			if (br.readBit())
+				br.readLiteral(6 + 1);
+		}
+	}
+
+	//Quantization
+	br.readLiteral(8);
+	for (int i = 0; i < 3; ++i)
+	{
+		if (br.readBit())
+			br.readLiteral(4 + 1);
+	}
+
+	//Segmentation
+	if (br.readBit())
+	{
+		if (br.readBit()) //update_map
+		{
+			for (int i = 0; i < 7; ++i)
+			{
+				if (br.readBit())
+					br.readLiteral(8);
+			}
+			if (br.readBit()) //temporal_update
+			{
+				for (int i = 0; i < 3; ++i)
+				{
+					if (br.readBit())
+						br.readLiteral(8);
+				}
+			}
+		}
+		if (br.readBit()) //update_data
+		{
+			static const int featureBits[4] = { 8 + 1, 6 + 1, 2, 0 }; //Quantizer and loop filter are signed
+			br.readBit(); //abs_or_delta_update
+			for (int i = 0; i < 8; ++i)
+			{
+				for (int j = 0; j < 4; ++j)
+				{
+					if (br.readBit())
+						br.readLiteral(featureBits[j]);
+				}
+			}
+		}
+	}
+
+	//Tiles, columns are at most 64 superblocks wide and at least 4
+	const int sb64Cols = (((info.width + 7) >> 3) + 7) >> 3;
+	int minLog2 = 0;
+	while ((64 << minLog2) < sb64Cols)
+		++minLog2;
+	int maxLog2 = 1;
+	while ((sb64Cols >> maxLog2) >= 4)
+		++maxLog2;
+	--maxLog2;
+
+	int columnsLog2 = minLog2;
+	while (columnsLog2 < maxLog2 && br.readBit())
+		++columnsLog2;
+	int rowsLog2 = br.readBit();
+	if (rowsLog2)
+		rowsLog2 += br.readBit();
+
+	info.columnTiles = 1 << columnsLog2;
+	info.rowTiles = 1 << rowsLog2;
+	return !br.overrun();
+}
+
+bool getVP8StreamInfo(const unsigned char *data, size_t size, VPXDecoder::StreamInfo &info)
+{
+	//Keyframes have a start code and the size after the frame tag
+	if (size < 10 || (data[0] & 1) || data[3] != 0x9d || data[4] != 0x01 || data[5] != 0x2a)
+		return false;
+
+	info.width = (data[6] | (data[7] << 8)) & 0x3fff;
+	info.height = (data[8] | (data[9] << 8)) & 0x3fff;
+	info.columnTiles = 1;
+	info.rowTiles = 1;
+	info.frameParallel = false;
+	return true;
+}
+
+}
+
+bool VPXDecoder::getStreamInfo(const WebMFrame &keyFrame, WebMDemuxer::VIDEO_CODEC codec, StreamInfo &info)
+{
+	if (!keyFrame.buffer || !keyFrame.bufferSize)
+		return false;
+
+	if (codec == WebMDemuxer::VIDEO_VP8)
+		return getVP8StreamInfo(keyFrame.buffer, keyFrame.bufferSize, info);
+	if (codec == WebMDemuxer::VIDEO_VP9)
+		return getVP9StreamInfo(keyFrame.buffer, keyFrame.bufferSize, info);
+	return false;
+}
+
+unsigned VPXDecoder::pickThreads(WebMDemuxer::VIDEO_CODEC codec, const StreamInfo &info, unsigned budget, THREAD_MODE &mode, bool frameThreads)
+{
+	mode = THREAD_TILES;
+	if (budget < 1)
+		budget = 1;
+
+	//VP8 threads work on macroblock rows
+	if (codec == WebMDemuxer::VIDEO_VP8)
+	{
+		const unsigned mbRows = (unsigned)(info.height + 15) / 16;
+		return budget < mbRows ? budget : mbRows;
+	}
+
+	//Enough tile columns to go round
+	const unsigned columns = (unsigned)info.columnTiles;
+	if (columns >= budget)
+		return budget;
+
+	//Whole frames at once keeps every thread busy but delays output by a frame per thread,
+	//without row threading it's the only way to use more threads than columns
+#ifndef VPX_CTRL_VP9_DECODE_SET_ROW_MT
+	frameThreads = true;
+#endif
+	if (frameThreads && info.frameParallel)
+	{
+		mode = THREAD_FRAMES;
+		return budget;
+	}
+
+#ifdef VPX_CTRL_VP9_DECODE_SET_ROW_MT
+	//Row based threading keeps the rest busy inside the tiles
+	const unsigned sbRows = (unsigned)(info.height + 63) / 64;
+	mode = THREAD_ROWS;
+	return budget < sbRows ? budget : sbRows;
+#else
+	return columns;
+#endif
+}
+
+bool VPXDecoder::isDroppable(const WebMFrame &frame, const WebMFrame *next) const
+{
+	const unsigned char *data = frame.buffer;
+	const size_t size = frame.bufferSize;
+	if (!data || !size)
+		return false;
+
+	if (m_codec == WebMDemuxer::VIDEO_VP8)
+		return isDroppableVP8Frame(data, size);
+	if (m_codec != WebMDemuxer::VIDEO_VP9)
+		return false;
+
+	//Whatever is decoded after a dropped frame takes its motion vectors from the frame before it
+	//instead, unless it doesn't use the previous frame's at all. A superframe's frames start at its
+	//beginning, so the first frame of the next packet is what to look at
+	if (!next || !next->buffer || !next->bufferSize || !isVP9PrevMvsReset(next->buffer, next->bufferSize))
+		return false;
+
+	//A superframe packs several frames together, usually a hidden alt-ref with the shown frame.
+	//Its index is at the end, every frame in it has to be droppable and every one after the first
+	//has to stand alone from the one before it
+	const unsigned char marker = data[size - 1];
+	if ((marker & 0xE0) == 0xC0)
+	{
+		const int frames = (marker & 0x7) + 1;
+		const int mag = ((marker >> 3) & 0x3) + 1;
+		const size_t indexSize = 2 + mag * frames;
+		if (size >= indexSize && data[size - indexSize] == marker)
+		{
+			const unsigned char *index = data + size - indexSize + 1;
+			size_t offset = 0;
+			for (int i = 0; i < frames; ++i)
+			{
+				size_t frameSize = 0;
+				for (int j = 0; j < mag; ++j)
+					frameSize |= (size_t)*index++ << (j * 8);
+				if (offset + frameSize > size - indexSize || !isDroppableVP9Frame(data + offset, frameSize))
+					return false;
+				if (i > 0 && !isVP9PrevMvsReset(data + offset, frameSize))
+					return false;
+				offset += frameSize;
+			}
+			return true;
+		}
+	}
+
+	return isDroppableVP9Frame(data, size);
+}
+
 static inline int ceilRshift(int val, int shift)
 {
 	return (val + (1 << shift) - 1) >> shift;
@@ -31,12 +31,15 @@
 #include "WebMDemuxer.hpp"
 
 struct vpx_codec_ctx;
+struct vpx_codec_frame_buffer;
 
 class VPXDecoder
 {
 	VPXDecoder(const VPXDecoder &);
 	void operator =(const VPXDecoder &);
 public:
+	struct FrameBuffer;
+
 	class Image
 	{
 	public:
@@ -48,6 +51,8 @@ public:
 		int chromaShiftW, chromaShiftH;
 		unsigned char *planes[3];
 		int linesize[3];
+		FrameBuffer *buffer; //Pooled buffer the planes live in, NULL when they're libvpx's own
+		double time; //Of the packet the image was decoded from, with frame threading that's a few decodes back
 	};
 
 	enum IMAGE_ERROR
@@ -57,7 +62,28 @@ public:
 		NO_FRAME
 	};
 
-	VPXDecoder(const WebMDemuxer &demuxer, unsigned threads = 1);
+	enum THREAD_MODE
+	{
+		THREAD_TILES, //VP9 threads split tile columns, no more useful threads than there are columns
+		THREAD_ROWS, //VP9 row based threading, works within tiles
+		THREAD_FRAMES //VP9 frames decoded in parallel, output is delayed by threads - 1 frames
+	};
+
+	struct StreamInfo
+	{
+		int width, height;
+		int columnTiles, rowTiles; //Always 1 for VP8
+		bool frameParallel; //No frame's probabilities depend on the one before it
+	};
+
+	//Reads the size and tile layout from a keyframe's header
+	static bool getStreamInfo(const WebMFrame &keyFrame, WebMDemuxer::VIDEO_CODEC codec, StreamInfo &info);
+	//How many of budget threads the stream can keep busy, and how they should be used. Frame threading
+	//is only picked for frame parallel streams, and only with frameThreads when row threading is available
+	static unsigned pickThreads(WebMDemuxer::VIDEO_CODEC codec, const StreamInfo &info, unsigned budget, THREAD_MODE &mode, bool frameThreads = false);
+
+	//heldFrames is how many images the caller may retain at once, it bounds the frame buffer pool
+	VPXDecoder(const WebMDemuxer &demuxer, unsigned threads = 1, THREAD_MODE threadMode = THREAD_TILES, unsigned heldFrames = 0);
 	~VPXDecoder();
 
 	inline bool isOpen() const
@@ -71,12 +97,43 @@ public:
 	}
 
 	bool decode(const WebMFrame &frame);
+	//Pushes out the frames still in flight with frame threading, they come out of getImage as usual.
+	//Needed at the end of the stream and before seeking or looping, or the last getFramesDelay() frames are lost
+	bool flush();
+	//Readies the decoder for another stream of the same codec, which has to start on a keyframe.
+	//libvpx's threads and buffers are kept, which is the point over making a new decoder
+	void reset();
 	IMAGE_ERROR getImage(Image &image); //The data is NOT copied! Only 3-plane, 8-bit images are supported.
 
+	//Keeps a pooled image's planes valid past the next decode until released.
+	//Returns false if the image isn't pooled (VP8 can't use external buffers), its planes then have to be copied
+	bool retainImage(const Image &image);
+	void releaseImage(const Image &image);
+
+	//Reads just the frame headers to see if skipping the frame would change how anything after it
+	//decodes, if it wouldn't it can be dropped without being decoded at all. next is the packet that
+	//will be decoded in its place, NULL if there isn't one yet.
+	//Only frames that update no references, saved probabilities, segmentation or loop filter deltas
+	//qualify. VP9 also rules out error resilient, intra only and show existing frames, and needs next
+	//to start with a frame that doesn't take motion vectors from the frame before it. That means a
+	//keyframe, intra only or error resilient frame, so in an ordinary VP9 stream only the frames just
+	//before a keyframe are ever dropped this way. Anything the headers can't rule out is decoded
+	bool isDroppable(const WebMFrame &frame, const WebMFrame *next) const;
+
 private:
+	struct FramePool;
+
+	static int getFrameBuffer(void *priv, size_t minSize, vpx_codec_frame_buffer *fb);
+	static int releaseFrameBuffer(void *priv, vpx_codec_frame_buffer *fb);
+
 	vpx_codec_ctx *m_ctx;
+	FramePool *m_pool;
+	WebMDemuxer::VIDEO_CODEC m_codec;
 	const void *m_iter;
 	int m_delay;
+	//Packet times by decode count, images carry the count back out as their user_priv
+	double m_times[16];
+	unsigned m_decodeCount;
 	int m_last_space;
 };
 
@@ -24,7 +24,9 @@
 
 #include "WebMDemuxer.hpp"
 
-#include "mkvparser/mkvparser.h"
+#include "video_reader.h"
+#include "video_index.h"
+#include "common/webmids.h"
 
 #include <assert.h>
 #include <stdlib.h>
@@ -32,18 +34,20 @@
 
 WebMFrame::WebMFrame() :
 	bufferSize(0), bufferCapacity(0),
-	buffer(NULL),
+	buffer(NULL), storage(NULL),
 	time(0),
-	key(false)
+	key(false),
+	discardable(false),
+	discardPadding(0.0)
 {}
 WebMFrame::~WebMFrame()
 {
-	free(buffer);
+	free(storage);
 }
 
 /**/
 
-WebMDemuxer::WebMDemuxer(mkvparser::IMkvReader *reader, int videoTrack, int audioTrack) :
+WebMDemuxer::WebMDemuxer(CVideoReader *reader, int videoTrack, int audioTrack) :
 	m_reader(reader),
 	m_segment(NULL),
 	m_cluster(NULL), m_block(NULL), m_blockEntry(NULL),
@@ -52,7 +56,10 @@ WebMDemuxer::WebMDemuxer(mkvparser::IMkvReader *reader, int videoTrack, int audi
 	m_audioTrack(NULL), m_aCodec(NO_AUDIO),
 	m_isOpen(false),
 	m_eos(false),
-	m_framerate(0.0)
+	m_framerate(0.0),
+	m_prefetchClusters(2),
+	m_prefetchedEnd(0),
+	m_index(NULL)
 {
 	long long pos = 0;
 	if (mkvparser::EBMLHeader().Parse(m_reader, pos))
@@ -61,7 +68,12 @@ WebMDemuxer::WebMDemuxer(mkvparser::IMkvReader *reader, int videoTrack, int audi
 	if (mkvparser::Segment::CreateInstance(m_reader, pos, m_segment))
 		return;
 
-	if (m_segment->Load() < 0)
+	//Only the headers and the first cluster, the rest are found as playback gets to them
+	//so opening doesn't depend on how long the file is
+	if (m_segment->ParseHeaders() != 0)
+		return;
+	loadCues();
+	if (m_segment->LoadCluster() < 0)
 		return;
 
 	const mkvparser::Tracks *tracks = m_segment->GetTracks();
@@ -101,6 +113,7 @@ WebMDemuxer::WebMDemuxer(mkvparser::IMkvReader *reader, int videoTrack, int audi
 }
 WebMDemuxer::~WebMDemuxer()
 {
+	g_VideoPrefetcher.Cancel(m_reader);
 	delete m_segment;
 	//delete m_reader;
 }
@@ -162,7 +175,15 @@ bool WebMDemuxer::readFrame(WebMFrame *videoFrame, WebMFrame *audioFrame)
 		return false;
 
 	if (!m_cluster)
+	{
 		m_cluster = m_segment->GetFirst();
+		if (m_cluster->EOS())
+		{
+			m_eos = true;
+			return false;
+		}
+		readAheadCluster();
+	}
 
 	do
 	{
@@ -175,12 +196,13 @@ bool WebMDemuxer::readFrame(WebMFrame *videoFrame, WebMFrame *audioFrame)
 		}
 		else if (blockEntryEOS || m_blockEntry->EOS())
 		{
-			m_cluster = m_segment->GetNext(m_cluster);
-			if (!m_cluster || m_cluster->EOS())
+			m_cluster = nextCluster(m_cluster);
+			if (!m_cluster)
 			{
 				m_eos = true;
 				return false;
 			}
+			readAheadCluster();
 			status = m_cluster->GetFirst(m_blockEntry);
 			blockEntryEOS = false;
 			getNewBlock = true;
@@ -219,23 +241,215 @@ bool WebMDemuxer::readFrame(WebMFrame *videoFrame, WebMFrame *audioFrame)
 	}
 
 	const mkvparser::Block::Frame &blockFrame = m_block->GetFrame(m_blockFrameIndex++);
+
+	frame->time = m_block->GetTime(m_cluster) / 1e9;
+	frame->key  = m_block->IsKey();
+	frame->discardable = (frame == videoFrame) && isDiscardable(m_blockEntry);
+	//Only ever set on the last audio block, trimming it is what makes the end line up with the next loop
+	frame->discardPadding = (frame == audioFrame && m_block->GetDiscardPadding() > 0) ? m_block->GetDiscardPadding() / 1e9 : 0.0;
+
+	//Point straight at the data if the reader can keep it around, no copy needed
+	if (const unsigned char *data = m_reader->GetStablePointer(blockFrame.pos, blockFrame.len))
+	{
+		frame->buffer = data;
+		frame->bufferSize = blockFrame.len;
+		return true;
+	}
+
 	if (blockFrame.len > frame->bufferCapacity)
 	{
-		if ( frame->bufferCapacity != blockFrame.len )
+		unsigned char *newBuff = (unsigned char *)realloc(frame->storage, blockFrame.len);
+		if (newBuff)
 		{
-			unsigned char *newBuff = (unsigned char *)realloc(frame->buffer, frame->bufferCapacity = blockFrame.len);
-			if (newBuff)
-				frame->buffer = newBuff;
-			else // Out of memory
-				return false;
+			frame->storage = newBuff;
+			frame->bufferCapacity = blockFrame.len;
 		}
+		else // Out of memory
+			return false;
 	}
+	frame->buffer = frame->storage;
 	frame->bufferSize = blockFrame.len;
 
-	frame->time = m_block->GetTime(m_cluster) / 1e9;
-	frame->key  = m_block->IsKey();
+	return !blockFrame.Read(m_reader, frame->storage);
+}
+
+bool WebMDemuxer::seek(double time)
+{
+	const mkvparser::Track *track = m_videoTrack ? static_cast<const mkvparser::Track *>(m_videoTrack) : m_audioTrack;
+	if (!track)
+		return false;
+
+	const long long time_ns = (long long)(time * 1e9);
+	const mkvparser::BlockEntry *entry = NULL;
+
+	//The frame index knows the keyframe's time and which cluster it's in
+	if (m_index && m_index->IsValid() && track == m_videoTrack)
+	{
+		const CVideoFrameIndex::Frame_t &keyFrame = m_index->GetFrame(m_index->FindKeyFrame(m_index->FindFrame(time_ns)));
+		const CVideoFrameIndex::Cluster_t *indexCluster = m_index->FindCluster(keyFrame.time);
+		if (indexCluster)
+		{
+			if (const mkvparser::Cluster *cluster = m_segment->FindOrPreloadCluster(indexCluster->pos))
+				entry = cluster->GetEntry(track, keyFrame.time);
+		}
+	}
+
+	//Cues point straight at the keyframe's cluster, nothing before it needs parsing
+	const mkvparser::Cues *cues = m_segment->GetCues();
+	const mkvparser::CuePoint *cuePoint = NULL;
+	const mkvparser::CuePoint::TrackPosition *trackPosition = NULL;
+	if ((!entry || entry->EOS()) && cues && cues->Find(time_ns, track, cuePoint, trackPosition))
+		entry = cues->GetBlock(cuePoint, trackPosition);
+
+	if (!entry || entry->EOS())
+	{
+		//No cues for this track, load clusters until we're past the target and search through those
+		for (;;)
+		{
+			const mkvparser::Cluster *last = m_segment->GetLast();
+			if (!last->EOS() && last->GetTime() > time_ns)
+				break;
+			if (m_segment->LoadCluster() != 0)
+				break;
+		}
+
+		entry = NULL;
+		if (track->Seek(time_ns, entry) < 0 || !entry || entry->EOS())
+			return false;
+	}
 
-	return !blockFrame.Read(m_reader, frame->buffer);
+	m_cluster = entry->GetCluster();
+	m_blockEntry = entry;
+	m_block = entry->GetBlock();
+	m_blockFrameIndex = 0;
+	m_eos = false;
+	m_prefetchedEnd = 0;
+	readAheadCluster();
+	return true;
+}
+
+bool WebMDemuxer::buildIndex(CVideoFrameIndex &index, volatile bool *cancel)
+{
+	index.Purge();
+	if (!m_videoTrack)
+		return false;
+
+	//Only block headers get parsed, none of the frame data is read
+	const long trackNumber = m_videoTrack->GetNumber();
+	for (const mkvparser::Cluster *cluster = m_segment->GetFirst(); cluster && !cluster->EOS(); cluster = nextCluster(cluster))
+	{
+		if (cancel && *cancel)
+			return false;
+
+		index.AddCluster(cluster->GetPosition(), cluster->GetTime());
+
+		const mkvparser::BlockEntry *entry = NULL;
+		if (cluster->GetFirst(entry) < 0)
+			return false;
+		while (entry && !entry->EOS())
+		{
+			const mkvparser::Block *block = entry->GetBlock();
+			if (block->GetTrackNumber() == trackNumber)
+			{
+				const long long time = block->GetTime(cluster);
+				for (int i = 0; i < block->GetFrameCount(); ++i)
+					index.AddFrame(time, block->IsKey());
+			}
+			if (cluster->GetNext(entry, entry) < 0)
+				return false;
+		}
+	}
+
+	return index.IsValid();
+}
+
+bool WebMDemuxer::isDiscardable(const mkvparser::BlockEntry *blockEntry) const
+{
+	//Only SimpleBlocks carry the flag and mkvparser doesn't keep it, so read it from the block header:
+	//the track number as a vint, a 16 bit timecode, then the flags
+	if (blockEntry->GetKind() != mkvparser::BlockEntry::kBlockSimple)
+		return false;
+
+	const mkvparser::Block *block = blockEntry->GetBlock();
+	unsigned char header[8 + 2 + 1];
+	const long len = (long)(block->m_size < (long long)sizeof(header) ? block->m_size : (long long)sizeof(header));
+	if (len < 4 || m_reader->Read(block->m_start, len, header))
+		return false;
+
+	int trackLen = 1;
+	while (trackLen <= 8 && !(header[0] & (0x80 >> (trackLen - 1))))
+		++trackLen;
+	if (trackLen + 3 > len)
+		return false;
+
+	return (header[trackLen + 2] & 0x01) != 0;
+}
+
+void WebMDemuxer::readAheadCluster()
+{
+	if (!m_cluster || m_cluster->EOS())
+		return;
+
+	const long long size = m_cluster->GetElementSize();
+	if (size > 0)
+		m_reader->ReadAhead(m_cluster->m_element_start, size);
+
+	//Warm the next few clusters in the background, skipping anything already queued
+	const mkvparser::Cluster *cluster = m_cluster;
+	for (int i = 0; i < m_prefetchClusters; ++i)
+	{
+		cluster = nextCluster(cluster);
+		if (!cluster)
+			break;
+
+		const long long start = cluster->m_element_start;
+		const long long len = cluster->GetElementSize();
+		if (len <= 0 || start + len <= m_prefetchedEnd)
+			continue;
+
+		g_VideoPrefetcher.Queue(m_reader, start, len);
+		m_prefetchedEnd = start + len;
+	}
+}
+
+void WebMDemuxer::loadCues()
+{
+	//Cues are usually at the end of the file, so ParseHeaders won't have seen them, but the SeekHead knows where they are
+	const mkvparser::SeekHead *seekHead = m_segment->GetSeekHead();
+	if (!m_segment->GetCues() && seekHead)
+	{
+		for (int i = 0; i < seekHead->GetCount(); ++i)
+		{
+			const mkvparser::SeekHead::Entry *entry = seekHead->GetEntry(i);
+			if (entry && entry->id == libwebm::kMkvCues)
+			{
+				long long pos;
+				long len;
+				m_segment->ParseCues(entry->pos, pos, len);
+				break;
+			}
+		}
+	}
+
+	//There's one cue point per cluster at most, so just load them all now
+	if (const mkvparser::Cues *cues = m_segment->GetCues())
+	{
+		while (!cues->DoneParsing() && cues->LoadCuePoint())
+			;
+	}
+}
+
+const mkvparser::Cluster *WebMDemuxer::nextCluster(const mkvparser::Cluster *cluster)
+{
+	//Loads the next cluster's header if nothing has got that far yet
+	const mkvparser::Cluster *next = NULL;
+	long long pos;
+	long len;
+	if (m_segment->ParseNext(cluster, next, pos, len) != 0)
+		return NULL;
+	if (!next || next->EOS())
+		return NULL;
+	return next;
 }
 
 inline bool WebMDemuxer::notSupportedTrackNumber(long videoTrackNumber, long audioTrackNumber) const
@@ -249,6 +463,13 @@ double WebMDemuxer::getFrameRate()
 	if ( m_framerate != 0.0 )
 		return m_framerate;
 
+	// exact if we've an index
+	if ( m_index && m_index->GetFrameRate() > 0.0 )
+	{
+		m_framerate = m_index->GetFrameRate();
+		return m_framerate;
+	}
+
 	// guess the framerate
 	WebMFrame videoframe;
 	unsigned int i = 0;
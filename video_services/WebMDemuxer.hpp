@@ -40,6 +40,9 @@ namespace mkvparser {
 	class AudioTrack;
 }
 
+class CVideoReader;
+class CVideoFrameIndex;
+
 class WebMFrame
 {
 	WebMFrame(const WebMFrame &);
@@ -52,11 +55,18 @@ public:
 	{
 		return bufferSize > 0;
 	}
+	inline bool isBorrowed() const
+	{
+		return buffer && buffer != storage;
+	}
 
 	long bufferSize, bufferCapacity;
-	unsigned char *buffer;
+	const unsigned char *buffer; //Either storage or borrowed from the reader, borrowed data lives as long as the reader does
+	unsigned char *storage;
 	double time;
 	bool key;
+	bool discardable; //Flagged as not referenced by any other frame, safe to skip decoding
+	double discardPadding; //Seconds of decoded audio at the end of the frame that aren't part of the stream
 };
 
 class WebMDemuxer
@@ -77,7 +87,7 @@ public:
 		AUDIO_OPUS
 	};
 
-	WebMDemuxer(mkvparser::IMkvReader *reader, int videoTrack = 0, int audioTrack = 0);
+	WebMDemuxer(CVideoReader *reader, int videoTrack = 0, int audioTrack = 0);
 	~WebMDemuxer();
 
 	inline bool isOpen() const
@@ -103,20 +113,36 @@ public:
 
 	bool readFrame(WebMFrame *videoFrame, WebMFrame *audioFrame);
 
+	//Moves to the last keyframe at or before time, the next readFrame returns it
+	bool seek(double time);
+
 	void resetVideo() {
 		m_cluster = nullptr;
 		m_blockFrameIndex = 0; 
 		m_eos = false;
 		m_blockEntry = nullptr;
+		m_prefetchedEnd = 0;
 	}
 
+	//How many clusters past the current one get warmed on the prefetch thread
+	void setPrefetchClusters(int count) { m_prefetchClusters = count; }
+
+	//Walks every cluster and records each video frame, stops early and returns false if cancel gets set
+	bool buildIndex(CVideoFrameIndex &index, volatile bool *cancel = NULL);
+	//Used for seeking and the framerate when set, must outlive the demuxer or be cleared
+	void setIndex(const CVideoFrameIndex *index) { m_index = index; }
+
 	int getFrameIndex() { return m_blockFrameIndex; }
 	double getFrameRate();
 
 private:
 	inline bool notSupportedTrackNumber(long videoTrackNumber, long audioTrackNumber) const;
+	void readAheadCluster();
+	bool isDiscardable(const mkvparser::BlockEntry *blockEntry) const;
+	void loadCues();
+	const mkvparser::Cluster *nextCluster(const mkvparser::Cluster *cluster);
 
-	mkvparser::IMkvReader *m_reader;
+	CVideoReader *m_reader;
 	mkvparser::Segment *m_segment;
 
 	const mkvparser::Cluster *m_cluster;
@@ -135,6 +161,11 @@ private:
 	bool m_eos;
 
 	double m_framerate;
+
+	int m_prefetchClusters;
+	long long m_prefetchedEnd;
+
+	const CVideoFrameIndex *m_index;
 };
 
 #endif // WEBMDEMUXER_HPP
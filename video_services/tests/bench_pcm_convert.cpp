@@ -0,0 +1,75 @@
+//===========================================================================//
+//
+// Purpose: Times the conversion of decoded sound to S16 against the plain loop
+//			it replaced, for the channel layouts videos usually come with
+//
+//===========================================================================//
+
+#include "PCMConvert.hpp"
+#include "tier0/dbg.h"
+#include "tier0/platform.h"
+#include "tier1/utlvector.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+// about what a Vorbis packet decodes to
+#define PCM_BENCH_FRAMES 1024
+#define PCM_BENCH_ITERATIONS 20000
+#define PCM_BENCH_MAX_CHANNELS 8
+
+typedef void ( *PCMConvertFn_t )( float **planes, int channels, int count, short *out );
+
+static void ConvertScalar( float **planes, int channels, int count, short *out )
+{
+	floatToS16Scalar( planes, channels, 0, count, out );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Nanoseconds per sample. What's converted is summed and handed back so
+//			none of the work can be thrown away
+//-----------------------------------------------------------------------------
+static double TimeConvert( PCMConvertFn_t pfnConvert, float **ppPlanes, int nChannels, short *pOut, int &nChecksum )
+{
+	// once to warm up
+	pfnConvert( ppPlanes, nChannels, PCM_BENCH_FRAMES, pOut );
+
+	const double flStart = Plat_FloatTime();
+	for ( int i = 0; i < PCM_BENCH_ITERATIONS; ++i )
+	{
+		pfnConvert( ppPlanes, nChannels, PCM_BENCH_FRAMES, pOut );
+		nChecksum += pOut[ i % ( PCM_BENCH_FRAMES * nChannels ) ];
+	}
+	const double flTime = Plat_FloatTime() - flStart;
+	return flTime * 1e9 / ( ( double )PCM_BENCH_ITERATIONS * PCM_BENCH_FRAMES * nChannels );
+}
+
+int main( int argc, char **argv )
+{
+	static const int s_channels[] = { 1, 2, 6, 8 };
+
+	CUtlVector< float > planes[ PCM_BENCH_MAX_CHANNELS ];
+	float *ppPlanes[ PCM_BENCH_MAX_CHANNELS ];
+	for ( int c = 0; c < PCM_BENCH_MAX_CHANNELS; ++c )
+	{
+		// a little past full scale either way, so the clamping is exercised too
+		planes[ c ].SetCount( PCM_BENCH_FRAMES );
+		for ( int i = 0; i < PCM_BENCH_FRAMES; ++i )
+			planes[ c ][ i ] = ( float )( ( i * 7919 + c * 104729 ) % 2401 - 1200 ) / 1000.0f;
+		ppPlanes[ c ] = planes[ c ].Base();
+	}
+
+	CUtlVector< short > out;
+	out.SetCount( PCM_BENCH_FRAMES * PCM_BENCH_MAX_CHANNELS );
+
+	int nChecksum = 0;
+	Msg( "%d frames, %d times\n", PCM_BENCH_FRAMES, PCM_BENCH_ITERATIONS );
+	for ( int i = 0; i < ARRAYSIZE( s_channels ); ++i )
+	{
+		const double flScalar = TimeConvert( ConvertScalar, ppPlanes, s_channels[ i ], out.Base(), nChecksum );
+		const double flConvert = TimeConvert( floatToS16, ppPlanes, s_channels[ i ], out.Base(), nChecksum );
+		Msg( "%d channels: %.2f -> %.2f ns/sample\n", s_channels[ i ], flScalar, flConvert );
+	}
+	Msg( "checksum %d\n", nChecksum );
+	return 0;
+}
@@ -0,0 +1,143 @@
+//===========================================================================//
+//
+// Purpose: The sound conversions against the plain loops they replaced
+//
+//===========================================================================//
+
+#include "video_tests.h"
+#include "PCMConvert.hpp"
+#include "tier1/utlvector.h"
+
+#include <string.h>
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define PCM_TEST_MAX_CHANNELS 8
+// past the end of the output, to catch anything written beyond it
+#define PCM_TEST_GUARD 16
+#define PCM_TEST_GUARD_VALUE ( short )0x5a5a
+
+static float MakeNaN()
+{
+	const unsigned int bits = 0x7fc00000;
+	float f;
+	memcpy( &f, &bits, sizeof( f ) );
+	return f;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: What a decoder could give. Mostly in range, but with full scale, past it
+//			either way, either side of the rounding to zero and NaN mixed in. Far
+//			enough past full scale the old loop's int conversion overflows, which
+//			never had a defined answer, so that isn't tested
+//-----------------------------------------------------------------------------
+static float GetSample( int nChannel, int i )
+{
+	const unsigned int nHash = ( unsigned int )( i * 2654435761u ) ^ ( unsigned int )( nChannel * 40503u );
+	switch ( nHash % 13 )
+	{
+	case 0:		return 1.0f;
+	case 1:		return -1.0f;
+	case 2:		return 1.5f;
+	case 3:		return -1.75f;
+	case 4:		return 0.9f / 32767.0f;
+	case 5:		return -0.9f / 32767.0f;
+	case 6:		return -0.0f;
+	case 7:		return MakeNaN();
+	default:	return ( float )( ( int )( nHash >> 8 ) % 20001 - 10000 ) / 9000.0f;
+	}
+}
+
+static void FillPlanes( CUtlVector< float > *pPlanes, float **ppPlanes, int nChannels, int nCount )
+{
+	for ( int c = 0; c < nChannels; ++c )
+	{
+		pPlanes[ c ].SetCount( nCount + 1 );
+		for ( int i = 0; i < nCount; ++i )
+			pPlanes[ c ][ i ] = GetSample( c, i );
+		ppPlanes[ c ] = pPlanes[ c ].Base();
+	}
+}
+
+static bool GuardIntact( const short *pGuard )
+{
+	for ( int i = 0; i < PCM_TEST_GUARD; ++i )
+	{
+		if ( pGuard[ i ] != PCM_TEST_GUARD_VALUE )
+			return false;
+	}
+	return true;
+}
+
+static void TestFloatToS16( int nChannels, int nCount )
+{
+	CUtlVector< float > planes[ PCM_TEST_MAX_CHANNELS ];
+	float *ppPlanes[ PCM_TEST_MAX_CHANNELS ];
+	FillPlanes( planes, ppPlanes, nChannels, nCount );
+
+	const int nSamples = nCount * nChannels;
+	CUtlVector< short > expected, converted;
+	expected.SetCount( nSamples + PCM_TEST_GUARD );
+	converted.SetCount( nSamples + PCM_TEST_GUARD );
+	for ( int i = 0; i < expected.Count(); ++i )
+		expected[ i ] = converted[ i ] = PCM_TEST_GUARD_VALUE;
+
+	floatToS16Scalar( ppPlanes, nChannels, 0, nCount, expected.Base() );
+	floatToS16( ppPlanes, nChannels, nCount, converted.Base() );
+
+	// exactly the same, NaN and saturation included
+	int nFirstDifference = -1;
+	for ( int i = 0; i < nSamples && nFirstDifference < 0; ++i )
+	{
+		if ( converted[ i ] != expected[ i ] )
+			nFirstDifference = i;
+	}
+	if ( nFirstDifference >= 0 )
+		Warning( "%d channels, %d frames: sample %d is %d, not %d\n", nChannels, nCount, nFirstDifference, converted[ nFirstDifference ], expected[ nFirstDifference ] );
+	VIDEO_TEST_CHECK( nFirstDifference < 0 );
+	VIDEO_TEST_CHECK( GuardIntact( converted.Base() + nSamples ) );
+
+	// the kernels only ever do whole blocks and leave the rest to the loop
+	const int nBlocks = floatToS16SSE2( ppPlanes, nChannels, nCount, converted.Base() );
+	VIDEO_TEST_CHECK( nBlocks % 8 == 0 && nBlocks <= nCount );
+	VIDEO_TEST_CHECK( GuardIntact( converted.Base() + nSamples ) );
+}
+
+static void TestInterleaveFloat( int nChannels, int nCount )
+{
+	CUtlVector< float > planes[ PCM_TEST_MAX_CHANNELS ];
+	float *ppPlanes[ PCM_TEST_MAX_CHANNELS ];
+	FillPlanes( planes, ppPlanes, nChannels, nCount );
+
+	const int nSamples = nCount * nChannels;
+	CUtlVector< float > expected, converted;
+	expected.SetCount( nSamples + 1 );
+	converted.SetCount( nSamples + 1 );
+	for ( int c = 0; c < nChannels; ++c )
+	{
+		for ( int i = 0; i < nCount; ++i )
+			expected[ i * nChannels + c ] = ppPlanes[ c ][ i ];
+	}
+	converted[ nSamples ] = 1234.0f;
+
+	interleaveFloat( ppPlanes, nChannels, nCount, converted.Base() );
+
+	// compared as bits so NaN has to come through as it went in
+	VIDEO_TEST_CHECK( !memcmp( converted.Base(), expected.Base(), nSamples * sizeof( float ) ) );
+	VIDEO_TEST_CHECK( converted[ nSamples ] == 1234.0f );
+}
+
+void TestPCMConvert()
+{
+	// either side of the 8 frame blocks, and long enough to be a real packet
+	static const int s_counts[] = { 0, 1, 3, 7, 8, 9, 15, 16, 17, 63, 64, 65, 1021 };
+	for ( int nChannels = 1; nChannels <= PCM_TEST_MAX_CHANNELS; ++nChannels )
+	{
+		for ( int i = 0; i < ARRAYSIZE( s_counts ); ++i )
+		{
+			TestFloatToS16( nChannels, s_counts[ i ] );
+			TestInterleaveFloat( nChannels, s_counts[ i ] );
+		}
+	}
+}
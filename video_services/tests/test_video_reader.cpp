@@ -0,0 +1,222 @@
+//===========================================================================//
+//
+// Purpose: Reader tests, run against an in-memory stand-in for the filesystem
+//
+//===========================================================================//
+
+#include "video_tests.h"
+#include "video_reader.h"
+#include "tier1/strtools.h"
+#include "tier1/utlvector.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+//-----------------------------------------------------------------------------
+// Purpose: One file held in memory, counting what the reader asks of it. None
+//			of it is loose, so everything goes through the filesystem reader
+//-----------------------------------------------------------------------------
+class CMemoryVideoFileSystem : public IVideoFileSystem
+{
+public:
+	CMemoryVideoFileSystem( const char *pFileName, int nSize )
+	{
+		Q_strncpy( m_fileName, pFileName, sizeof( m_fileName ) );
+		m_data.SetCount( nSize );
+		for ( int i = 0; i < nSize; ++i )
+			m_data[ i ] = GetByte( i );
+
+		m_nOpenHandles = 0;
+		m_nOpenAsyncFiles = 0;
+		m_nSeeks = 0;
+		m_nReads = 0;
+		m_nAsyncReads = 0;
+		m_nAsyncBytes = 0;
+	}
+
+	// what's at pos, so a test can check a read without keeping its own copy
+	static unsigned char GetByte( long long pos )
+	{
+		return ( unsigned char )( pos * 31 + ( pos >> 8 ) );
+	}
+
+	bool GetLoosePath( const char *pFileName, const char *pPathID, char *pFullPath, int nMaxLen )
+	{
+		return false;
+	}
+
+	FileHandle_t Open( const char *pFileName, const char *pPathID )
+	{
+		if ( Q_stricmp( pFileName, m_fileName ) )
+			return nullptr;
+
+		++m_nOpenHandles;
+		return new int( 0 );
+	}
+	void Close( FileHandle_t hFile )
+	{
+		--m_nOpenHandles;
+		delete ( int * )hFile;
+	}
+	unsigned int Size( FileHandle_t hFile )
+	{
+		return m_data.Count();
+	}
+	void Seek( FileHandle_t hFile, int pos )
+	{
+		++m_nSeeks;
+		*( int * )hFile = clamp( pos, 0, m_data.Count() );
+	}
+	int Read( void *pOutput, int size, FileHandle_t hFile )
+	{
+		++m_nReads;
+		int &pos = *( int * )hFile;
+		size = min( size, m_data.Count() - pos );
+		Q_memcpy( pOutput, m_data.Base() + pos, size );
+		pos += size;
+		return size;
+	}
+
+	FSAsyncFile_t AsyncBeginRead( const char *pFileName, const char *pPathID )
+	{
+		++m_nOpenAsyncFiles;
+		return ( FSAsyncFile_t )this;
+	}
+	void AsyncEndRead( FSAsyncFile_t hAsyncFile )
+	{
+		--m_nOpenAsyncFiles;
+	}
+	bool AsyncReadAndWait( const FileAsyncRequest_t &request )
+	{
+		if ( request.hSpecificAsyncFile != ( FSAsyncFile_t )this || request.nOffset < 0 || request.nBytes > m_data.Count() - request.nOffset )
+			return false;
+
+		++m_nAsyncReads;
+		m_nAsyncBytes += request.nBytes;
+		Q_memcpy( request.pData, m_data.Base() + request.nOffset, request.nBytes );
+		return true;
+	}
+
+	int m_nOpenHandles;
+	int m_nOpenAsyncFiles;
+	int m_nSeeks;
+	int m_nReads;
+	int m_nAsyncReads;
+	long long m_nAsyncBytes;
+
+private:
+	char m_fileName[ MAX_PATH ];
+	CUtlVector< unsigned char > m_data;
+};
+
+static bool CheckRead( CVideoReader *pReader, long long pos, long len )
+{
+	CUtlVector< unsigned char > buf;
+	buf.SetCount( len );
+	if ( pReader->Read( pos, len, buf.Base() ) != 0 )
+		return false;
+
+	for ( long i = 0; i < len; ++i )
+	{
+		if ( buf[ i ] != CMemoryVideoFileSystem::GetByte( pos + i ) )
+			return false;
+	}
+	return true;
+}
+
+static void TestFileSystemReader()
+{
+	// a bit over one prefetch chunk, so warming it takes two async reads
+	const int nSize = 300 * 1024;
+	CMemoryVideoFileSystem fileSystem( "videos/test.webm", nSize );
+
+	CFileSystemMkvReader missing( "videos/missing.webm", "GAME", &fileSystem );
+	VIDEO_TEST_CHECK( !missing.IsOpen() );
+	VIDEO_TEST_CHECK( missing.Read( 0, 1, nullptr ) == -1 );
+
+	{
+		CFileSystemMkvReader reader( "videos/test.webm", "GAME", &fileSystem );
+		VIDEO_TEST_CHECK( reader.IsOpen() );
+		VIDEO_TEST_CHECK( fileSystem.m_nOpenHandles == 1 );
+		VIDEO_TEST_CHECK( fileSystem.m_nOpenAsyncFiles == 1 );
+
+		long long total = 0, available = 0;
+		VIDEO_TEST_CHECK( reader.Length( &total, &available ) == 0 );
+		VIDEO_TEST_CHECK( total == nSize && available == nSize );
+
+		// back to back reads carry on from where the handle is
+		VIDEO_TEST_CHECK( CheckRead( &reader, 0, 100 ) );
+		VIDEO_TEST_CHECK( CheckRead( &reader, 100, 5000 ) );
+		VIDEO_TEST_CHECK( fileSystem.m_nSeeks == 0 );
+
+		VIDEO_TEST_CHECK( CheckRead( &reader, 200000, 1000 ) );
+		VIDEO_TEST_CHECK( fileSystem.m_nSeeks == 1 );
+
+		// right up to the end is fine, past it isn't
+		VIDEO_TEST_CHECK( CheckRead( &reader, nSize - 10, 10 ) );
+		unsigned char byte;
+		VIDEO_TEST_CHECK( reader.Read( nSize - 10, 11, &byte ) == -1 );
+		VIDEO_TEST_CHECK( reader.Read( -1, 1, &byte ) == -1 );
+
+		// warming goes through the async reads a chunk at a time and doesn't move the handle
+		const int nSeeks = fileSystem.m_nSeeks;
+		reader.Warm( 0, nSize );
+		VIDEO_TEST_CHECK( fileSystem.m_nAsyncReads == 2 );
+		VIDEO_TEST_CHECK( fileSystem.m_nAsyncBytes == nSize );
+		VIDEO_TEST_CHECK( fileSystem.m_nSeeks == nSeeks );
+
+		// and stops at the end of the file
+		reader.Warm( nSize - 100, 1000 );
+		VIDEO_TEST_CHECK( fileSystem.m_nAsyncReads == 3 );
+		VIDEO_TEST_CHECK( fileSystem.m_nAsyncBytes == nSize + 100 );
+		reader.Warm( nSize, 1000 );
+		VIDEO_TEST_CHECK( fileSystem.m_nAsyncReads == 3 );
+	}
+
+	VIDEO_TEST_CHECK( fileSystem.m_nOpenHandles == 0 );
+	VIDEO_TEST_CHECK( fileSystem.m_nOpenAsyncFiles == 0 );
+}
+
+static void TestCreateVideoReader()
+{
+	const int nSize = 1024 * 1024 + 123;
+	CMemoryVideoFileSystem fileSystem( "videos/test.webm", nSize );
+
+	VIDEO_TEST_CHECK( CreateVideoReader( "videos/missing.webm", "GAME", &fileSystem ) == nullptr );
+	VIDEO_TEST_CHECK( fileSystem.m_nOpenHandles == 0 );
+
+	// nothing's loose, so this is the cached filesystem reader
+	CVideoReader *pReader = CreateVideoReader( "videos/test.webm", "GAME", &fileSystem );
+	VIDEO_TEST_CHECK( pReader != nullptr );
+	if ( !pReader )
+		return;
+
+	long long total = 0;
+	VIDEO_TEST_CHECK( pReader->Length( &total, nullptr ) == 0 && total == nSize );
+
+	// small reads come out of the page cache, one filesystem read per page
+	VIDEO_TEST_CHECK( CheckRead( pReader, 10, 20 ) );
+	VIDEO_TEST_CHECK( CheckRead( pReader, 40, 20 ) );
+	VIDEO_TEST_CHECK( fileSystem.m_nReads == 1 );
+
+	// across a page boundary, then across into the short last page
+	VIDEO_TEST_CHECK( CheckRead( pReader, CACHED_READER_PAGE_SIZE - 8, 16 ) );
+	VIDEO_TEST_CHECK( fileSystem.m_nReads == 2 );
+	VIDEO_TEST_CHECK( CheckRead( pReader, nSize - 200, 200 ) );
+	VIDEO_TEST_CHECK( fileSystem.m_nReads == 4 );
+
+	// the cache passes warming through to the filesystem reader
+	pReader->Warm( 0, 1000 );
+	VIDEO_TEST_CHECK( fileSystem.m_nAsyncReads == 1 );
+	VIDEO_TEST_CHECK( fileSystem.m_nAsyncBytes == 1000 );
+
+	delete pReader;
+	VIDEO_TEST_CHECK( fileSystem.m_nOpenHandles == 0 );
+	VIDEO_TEST_CHECK( fileSystem.m_nOpenAsyncFiles == 0 );
+}
+
+void TestVideoReader()
+{
+	TestFileSystemReader();
+	TestCreateVideoReader();
+}
@@ -0,0 +1,36 @@
+//===========================================================================//
+//
+// Purpose: Runs the video services tests that don't need the engine running
+//
+//===========================================================================//
+
+#include "video_tests.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+int g_nVideoTestFailures = 0;
+
+struct VideoTest_t
+{
+	const char *pName;
+	void ( *pfnRun )();
+};
+
+static const VideoTest_t s_tests[] =
+{
+	{ "reader", TestVideoReader },
+	{ "pcm convert", TestPCMConvert },
+};
+
+int main( int argc, char **argv )
+{
+	for ( int i = 0; i < ARRAYSIZE( s_tests ); ++i )
+	{
+		const int nFailuresBefore = g_nVideoTestFailures;
+		s_tests[ i ].pfnRun();
+		Msg( "%s: %s\n", s_tests[ i ].pName, g_nVideoTestFailures == nFailuresBefore ? "passed" : "FAILED" );
+	}
+
+	return g_nVideoTestFailures ? 1 : 0;
+}
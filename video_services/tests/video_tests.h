@@ -0,0 +1,25 @@
+#ifndef VIDEO_TESTS_H
+#define VIDEO_TESTS_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/dbg.h"
+
+// Failures are counted rather than stopping the test, so one run shows everything that's wrong
+extern int g_nVideoTestFailures;
+
+#define VIDEO_TEST_CHECK( expr ) \
+	do \
+	{ \
+		if ( !( expr ) ) \
+		{ \
+			Warning( "%s(%d): check failed: %s\n", __FILE__, __LINE__, #expr ); \
+			++g_nVideoTestFailures; \
+		} \
+	} while ( 0 )
+
+void TestVideoReader();
+void TestPCMConvert();
+
+#endif
@@ -0,0 +1,121 @@
+//===========================================================================//
+//
+// Purpose: Single producer, single consumer ring for video sound
+//
+//===========================================================================//
+
+#include "video_audio_ring.h"
+#include "tier0/dbg.h"
+#include "tier1/strtools.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+CVideoAudioRing::CVideoAudioRing()
+{
+	m_pData = nullptr;
+	m_nSize = 0;
+	m_nWritePos = 0;
+	m_nReadPos = 0;
+	m_nDiscardPos = 0;
+}
+
+CVideoAudioRing::~CVideoAudioRing()
+{
+	Purge();
+}
+
+void CVideoAudioRing::Init( int nBytes )
+{
+	unsigned int nSize = 1;
+	while ( nSize < ( unsigned int )nBytes )
+		nSize <<= 1;
+
+	if ( nSize != m_nSize )
+	{
+		Purge();
+		m_pData = new unsigned char[ nSize ];
+		m_nSize = nSize;
+	}
+
+	m_nWritePos = 0;
+	m_nReadPos = 0;
+	m_nDiscardPos = 0;
+}
+
+void CVideoAudioRing::Purge()
+{
+	delete[] m_pData;
+	m_pData = nullptr;
+	m_nSize = 0;
+}
+
+int CVideoAudioRing::GetWriteSpace() const
+{
+	const unsigned int nWritePos = ( unsigned int )m_nWritePos;
+	const unsigned int nReadPos = ( unsigned int )m_nReadPos;
+	return ( int )( m_nSize - ( nWritePos - nReadPos ) );
+}
+
+int CVideoAudioRing::Write( const void *pData, int nBytes )
+{
+	const int nSpace = GetWriteSpace();
+	nBytes = min( nBytes, nSpace );
+	if ( nBytes <= 0 )
+		return 0;
+	// the consumer's done with that room before we write over it
+	ThreadMemoryBarrier();
+
+	const unsigned int nWritePos = ( unsigned int )m_nWritePos;
+	const unsigned int nOffset = nWritePos & ( m_nSize - 1 );
+	const int nFirst = min( nBytes, ( int )( m_nSize - nOffset ) );
+	Q_memcpy( m_pData + nOffset, pData, nFirst );
+	if ( nFirst < nBytes )
+		Q_memcpy( m_pData, ( const unsigned char * )pData + nFirst, nBytes - nFirst );
+
+	// the exchange is a full barrier, so the data is there before the consumer can see it
+	m_nWritePos = ( int )( nWritePos + nBytes );
+	return nBytes;
+}
+
+int CVideoAudioRing::GetQueued() const
+{
+	const unsigned int nWritePos = ( unsigned int )m_nWritePos;
+	unsigned int nReadPos = ( unsigned int )m_nReadPos;
+	const unsigned int nDiscardPos = ( unsigned int )m_nDiscardPos;
+	if ( ( int )( nDiscardPos - nReadPos ) > 0 )
+		nReadPos = nDiscardPos;
+	return ( int )( nWritePos - nReadPos );
+}
+
+void CVideoAudioRing::Discard()
+{
+	m_nDiscardPos = ( int )m_nWritePos;
+}
+
+int CVideoAudioRing::Read( void *pData, int nBytes )
+{
+	if ( !m_pData )
+		return 0;
+
+	// skip whatever was discarded, unless we've already read past it
+	unsigned int nReadPos = ( unsigned int )m_nReadPos;
+	const unsigned int nDiscardPos = ( unsigned int )m_nDiscardPos;
+	if ( ( int )( nDiscardPos - nReadPos ) > 0 )
+		nReadPos = nDiscardPos;
+
+	const unsigned int nWritePos = ( unsigned int )m_nWritePos;
+	nBytes = clamp( nBytes, 0, ( int )( nWritePos - nReadPos ) );
+	// nothing gets read from the buffer ahead of seeing the position that says it's there
+	ThreadMemoryBarrier();
+
+	const unsigned int nOffset = nReadPos & ( m_nSize - 1 );
+	const int nFirst = min( nBytes, ( int )( m_nSize - nOffset ) );
+	Q_memcpy( pData, m_pData + nOffset, nFirst );
+	if ( nFirst < nBytes )
+		Q_memcpy( ( unsigned char * )pData + nFirst, m_pData, nBytes - nFirst );
+
+	// and the data is copied out before the producer can reuse its room
+	m_nReadPos = ( int )( nReadPos + nBytes );
+	return nBytes;
+}
@@ -0,0 +1,56 @@
+#ifndef VIDEO_AUDIO_RING_H
+#define VIDEO_AUDIO_RING_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/platform.h"
+#include "tier0/threadtools.h"
+
+//-----------------------------------------------------------------------------
+// Purpose: Sound on its way from the game thread to the mixer callback. One thread
+//			writes and one reads, neither ever waits on the other, and a read that
+//			finds less than it wanted takes what's there
+//-----------------------------------------------------------------------------
+class CVideoAudioRing
+{
+public:
+	CVideoAudioRing();
+	~CVideoAudioRing();
+
+	// Size is rounded up to a power of two. Neither side can be using it while these run,
+	// it's up to the owner to keep the consumer off it, see CVideoMaterial::SuspendAudioRing
+	void Init( int nBytes );
+	void Purge();
+
+	bool IsValid() const
+	{
+		return m_pData != nullptr;
+	}
+
+	// Producer side
+	// Room for writing, anything discarded that the consumer hasn't skipped yet still takes room
+	int GetWriteSpace() const;
+	// Writes as much as there's room for, returns how much that was
+	int Write( const void *pData, int nBytes );
+	// Written and still to be played, not counting anything discarded
+	int GetQueued() const;
+	// Everything written so far is skipped by the consumer's next read
+	void Discard();
+
+	// Consumer side
+	// Reads up to nBytes, returns how much there was
+	int Read( void *pData, int nBytes );
+
+private:
+	unsigned char *m_pData;
+	unsigned int m_nSize;
+
+	// positions only ever count up and are wrapped into the buffer when used. Each is
+	// only moved by one side, so seeing an old value just means less room or less to read
+	CInterlockedInt m_nWritePos;
+	CInterlockedInt m_nReadPos;
+	CInterlockedInt m_nDiscardPos;
+};
+
+#endif
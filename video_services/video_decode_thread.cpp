@@ -0,0 +1,725 @@
+//===========================================================================//
+//
+// Purpose: Decoding video frames ahead of the playhead on a shared pool of threads
+//
+//===========================================================================//
+
+#include "video_decode_thread.h"
+#include "WebMDemuxer.hpp"
+#include "tier0/dbg.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+CVideoDecodePool g_VideoDecodePool;
+CVideoDecoderCache g_VideoDecoderCache;
+
+//=============================================================================
+//
+// Decode stream
+//
+//=============================================================================
+CVideoDecodeStream::CVideoDecodeStream( VPXDecoder *pDecoder, VideoDecodePriority_t priority, int nReadyFrames )
+{
+	m_pDecoder = pDecoder;
+	m_priority = priority;
+
+	// one extra for the frame on screen, which can't be written over, and room for every
+	// frame frame threading holds back so a flush can always hand them all over
+	m_nSlots = max( nReadyFrames, 1 ) + 1 + ( pDecoder ? pDecoder->getFramesDelay() : 0 );
+	m_pSlots = new DecodedFrame_t[ m_nSlots ];
+	memset( m_pSlots, 0, sizeof( DecodedFrame_t ) * m_nSlots );
+	m_nReadHead = 0;
+	m_nReady = 0;
+
+	m_nInFlight = 0;
+	m_bEndOfStream = false;
+	m_lastQueuedTime = -1.0;
+	m_clock = 0.0;
+	m_nDropped = 0;
+	m_nSkippedDecodes = 0;
+	m_nDecodes = 0;
+	m_flDecodeTime = 0.0;
+	m_nGeneration = 0;
+	m_bBusy = false;
+
+	g_VideoDecodePool.AddStream( this );
+}
+
+CVideoDecodeStream::~CVideoDecodeStream()
+{
+	g_VideoDecodePool.RemoveStream( this );
+
+	if ( m_nDropped > 0 )
+	{
+		// what skipping saved, going by how long the frames we did decode took
+		const double flAverage = m_nDecodes > 0 ? m_flDecodeTime / m_nDecodes : 0.0;
+		DevMsg( "Video decode dropped %d late frames, %d without decoding saving ~%.1fms\n",
+			m_nDropped, m_nSkippedDecodes, m_nSkippedDecodes * flAverage * 1000.0 );
+	}
+
+	while ( m_packets.Count() > 0 )
+		delete m_packets.RemoveAtHead();
+
+	for ( int i = 0; i < m_nSlots; ++i )
+	{
+		ReleaseSlot( m_pSlots[ i ] );
+		free( m_pSlots[ i ].data );
+	}
+	delete[] m_pSlots;
+}
+
+void CVideoDecodeStream::QueuePacket( WebMFrame *pFrame )
+{
+	m_mutex.Lock();
+	m_packets.Insert( pFrame );
+	m_lastQueuedTime = pFrame->time;
+	m_bEndOfStream = false;
+	m_mutex.Unlock();
+
+	g_VideoDecodePool.Wake();
+}
+
+void CVideoDecodeStream::QueueEndOfStream()
+{
+	m_mutex.Lock();
+	const bool bWasEnded = m_bEndOfStream;
+	m_bEndOfStream = true;
+	m_mutex.Unlock();
+
+	if ( !bWasEnded )
+		g_VideoDecodePool.Wake();
+}
+
+bool CVideoDecodeStream::NeedsPackets()
+{
+	AUTO_LOCK( m_mutex );
+	return m_packets.Count() + m_nReady < m_nSlots;
+}
+
+bool CVideoDecodeStream::HasPendingFrames()
+{
+	AUTO_LOCK( m_mutex );
+	return m_packets.Count() > 0 || m_nReady > 0 || m_nInFlight > 0 || m_bBusy;
+}
+
+bool CVideoDecodeStream::GetNextFrameTime( double &time )
+{
+	AUTO_LOCK( m_mutex );
+	if ( m_nReady > 0 )
+	{
+		time = m_pSlots[ m_nReadHead ].time;
+		return true;
+	}
+	if ( m_packets.Count() > 0 )
+	{
+		time = m_packets.Head()->time;
+		return true;
+	}
+	return false;
+}
+
+double CVideoDecodeStream::GetLastQueuedTime()
+{
+	AUTO_LOCK( m_mutex );
+	return m_lastQueuedTime;
+}
+
+const DecodedFrame_t *CVideoDecodeStream::GetDueFrame( double curTime, int &nSkipped )
+{
+	nSkipped = 0;
+
+	m_mutex.Lock();
+	const DecodedFrame_t *pFrame = nullptr;
+	while ( m_nReady > 0 && m_pSlots[ m_nReadHead ].time <= curTime )
+	{
+		if ( pFrame )
+			++nSkipped;
+		pFrame = &m_pSlots[ m_nReadHead ];
+		m_nReadHead = ( m_nReadHead + 1 ) % m_nSlots;
+		--m_nReady;
+	}
+	m_nDropped += nSkipped;
+	m_mutex.Unlock();
+
+	// freed up some slots
+	if ( pFrame )
+		g_VideoDecodePool.Wake();
+
+	return pFrame;
+}
+
+void CVideoDecodeStream::SetClock( double curTime )
+{
+	AUTO_LOCK( m_mutex );
+	m_clock = curTime;
+}
+
+int CVideoDecodeStream::GetDroppedFrames()
+{
+	AUTO_LOCK( m_mutex );
+	return m_nDropped;
+}
+
+void CVideoDecodeStream::Flush()
+{
+	m_mutex.Lock();
+	while ( m_packets.Count() > 0 )
+		delete m_packets.RemoveAtHead();
+	// hand the decoder its buffers back, all but the one on screen
+	for ( int i = 0; i < m_nReady; ++i )
+		ReleaseSlot( m_pSlots[ ( m_nReadHead + i ) % m_nSlots ] );
+	m_nReady = 0;
+	m_lastQueuedTime = -1.0;
+	m_bEndOfStream = false;
+	++m_nGeneration;
+
+	// a frame takes milliseconds at worst, so this won't be long
+	while ( m_bBusy )
+	{
+		m_mutex.Unlock();
+		ThreadSleep( 1 );
+		m_mutex.Lock();
+	}
+
+	// nothing left for the pool to pick up, so the decoder is ours. Frames still in flight
+	// belong to before the flush and would otherwise come out in front of the next ones
+	const bool bInFlight = m_nInFlight > 0;
+	m_nInFlight = 0;
+	m_mutex.Unlock();
+
+	if ( bInFlight && m_pDecoder->flush() )
+	{
+		VPXDecoder::Image image;
+		while ( m_pDecoder->getImage( image ) != VPXDecoder::NO_FRAME )
+			;
+	}
+}
+
+bool CVideoDecodeStream::HasWork()
+{
+	AUTO_LOCK( m_mutex );
+	// frames in flight will come out into the ring too, so they need their slots kept for them
+	if ( m_packets.Count() > 0 )
+		return m_nReady + m_nInFlight < m_nSlots - 1;
+
+	// a flush can hand over every frame in flight at once
+	return m_bEndOfStream && m_nInFlight > 0 && m_nReady + m_nInFlight <= m_nSlots - 1;
+}
+
+double CVideoDecodeStream::GetSlack()
+{
+	AUTO_LOCK( m_mutex );
+	if ( m_packets.Count() == 0 )
+		return 0.0;
+
+	const double flAverage = m_nDecodes > 0 ? m_flDecodeTime / m_nDecodes : 0.0;
+	return m_packets.Head()->time - m_clock - flAverage;
+}
+
+void CVideoDecodeStream::DecodeNext()
+{
+	m_mutex.Lock();
+	if ( m_packets.Count() == 0 && m_bEndOfStream && m_nInFlight > 0 )
+	{
+		const int generation = m_nGeneration;
+		m_mutex.Unlock();
+		FlushDecoder( generation );
+		return;
+	}
+
+	// may have been flushed since the pool picked us
+	if ( m_packets.Count() == 0 || m_nReady + m_nInFlight >= m_nSlots - 1 )
+	{
+		m_mutex.Unlock();
+		return;
+	}
+
+	SkipToDueKeyFrame();
+
+	WebMFrame *pFrame = m_packets.RemoveAtHead();
+
+	// late and nothing after it depends on it, not worth decoding. The container may say so,
+	// otherwise the frame headers, its own and the next packet's, tell us
+	if ( IsSuperseded() && ( pFrame->discardable || m_pDecoder->isDroppable( *pFrame, m_packets.Head() ) ) )
+	{
+		++m_nDropped;
+		++m_nSkippedDecodes;
+		m_mutex.Unlock();
+		delete pFrame;
+		return;
+	}
+
+	const int generation = m_nGeneration;
+	m_bBusy = true;
+	m_mutex.Unlock();
+
+	// with frame threading an image comes out a few packets after the one it belongs to,
+	// the decoder hands each one back with its own packet's time
+	const double flDecodeStart = Plat_FloatTime();
+	const bool bDecoded = m_pDecoder->decode( *pFrame );
+	const double flDecodeTime = Plat_FloatTime() - flDecodeStart;
+	delete pFrame;
+
+	m_mutex.Lock();
+	if ( bDecoded && generation == m_nGeneration )
+		++m_nInFlight;
+	m_flDecodeTime += flDecodeTime;
+	++m_nDecodes;
+	m_mutex.Unlock();
+
+	if ( bDecoded )
+		ReceiveImages( generation );
+
+	m_mutex.Lock();
+	m_bBusy = false;
+	m_mutex.Unlock();
+}
+
+void CVideoDecodeStream::FlushDecoder( int generation )
+{
+	m_mutex.Lock();
+	if ( generation != m_nGeneration )
+	{
+		m_mutex.Unlock();
+		return;
+	}
+	m_bBusy = true;
+	m_mutex.Unlock();
+
+	const bool bFlushed = m_pDecoder->flush();
+	if ( bFlushed )
+		ReceiveImages( generation );
+
+	// whatever didn't come out isn't going to
+	m_mutex.Lock();
+	if ( generation == m_nGeneration )
+		m_nInFlight = 0;
+	m_bBusy = false;
+	m_mutex.Unlock();
+}
+
+void CVideoDecodeStream::ReceiveImages( int generation )
+{
+	VPXDecoder::Image image;
+	VPXDecoder::IMAGE_ERROR err;
+	while ( ( err = m_pDecoder->getImage( image ) ) != VPXDecoder::NO_FRAME )
+	{
+		// had to be decoded for the frames after it, but one of those is due already
+		m_mutex.Lock();
+		if ( generation == m_nGeneration && m_nInFlight > 0 )
+			--m_nInFlight;
+		const bool bSuperseded = err == VPXDecoder::NO_IMAGE_ERROR && IsSuperseded();
+		if ( bSuperseded )
+			++m_nDropped;
+		m_mutex.Unlock();
+
+		if ( err == VPXDecoder::NO_IMAGE_ERROR && !bSuperseded )
+			StoreImage( image, generation );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: If a queued keyframe is already due nothing before it can be shown or
+//			is needed to decode it, so throw it all away. Called with the lock held
+//-----------------------------------------------------------------------------
+void CVideoDecodeStream::SkipToDueKeyFrame()
+{
+	int nKeyFrame = 0;
+	for ( int i = 1; i < m_packets.Count() && m_packets[ i ]->time <= m_clock; ++i )
+	{
+		if ( m_packets[ i ]->key )
+			nKeyFrame = i;
+	}
+
+	for ( int i = 0; i < nKeyFrame; ++i )
+	{
+		delete m_packets.RemoveAtHead();
+		++m_nDropped;
+		++m_nSkippedDecodes;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: True if the next queued frame is due, so whatever comes before it would
+//			never be seen. Called with the lock held
+//-----------------------------------------------------------------------------
+bool CVideoDecodeStream::IsSuperseded()
+{
+	return m_packets.Count() > 0 && m_packets.Head()->time <= m_clock;
+}
+
+void CVideoDecodeStream::StoreImage( const VPXDecoder::Image &image, int generation )
+{
+	m_mutex.Lock();
+	if ( generation != m_nGeneration || m_nReady >= m_nSlots - 1 )
+	{
+		m_mutex.Unlock();
+		return;
+	}
+	DecodedFrame_t &slot = m_pSlots[ ( m_nReadHead + m_nReady ) % m_nSlots ];
+	m_mutex.Unlock();
+
+	// nobody else looks at the slot until it's counted as ready
+	ReleaseSlot( slot );
+
+	// pooled images can just be held onto, anything else gets copied out before the next decode reuses it
+	if ( m_pDecoder->retainImage( image ) )
+	{
+		slot.image = image;
+	}
+	else
+	{
+		size_t planeSize[ 3 ];
+		size_t totalSize = 0;
+		for ( int i = 0; i < 3; ++i )
+		{
+			planeSize[ i ] = ( size_t )image.linesize[ i ] * image.getHeight( i );
+			totalSize += planeSize[ i ];
+		}
+
+		if ( totalSize > slot.capacity )
+		{
+			unsigned char *pData = ( unsigned char * )realloc( slot.data, totalSize );
+			if ( !pData )
+				return;
+			slot.data = pData;
+			slot.capacity = totalSize;
+		}
+
+		slot.image = image;
+		slot.image.buffer = nullptr;
+		unsigned char *pDest = slot.data;
+		for ( int i = 0; i < 3; ++i )
+		{
+			memcpy( pDest, image.planes[ i ], planeSize[ i ] );
+			slot.image.planes[ i ] = pDest;
+			pDest += planeSize[ i ];
+		}
+	}
+	slot.time = image.time;
+
+	m_mutex.Lock();
+	if ( generation == m_nGeneration )
+		++m_nReady;
+	m_mutex.Unlock();
+}
+
+void CVideoDecodeStream::ReleaseSlot( DecodedFrame_t &slot )
+{
+	if ( slot.image.buffer )
+	{
+		m_pDecoder->releaseImage( slot.image );
+		slot.image.buffer = nullptr;
+	}
+}
+
+//=============================================================================
+//
+// Decode pool
+//
+//=============================================================================
+CVideoDecodePool::CVideoDecodePool()
+{
+	m_nThreadBudget = 0;
+	m_nDecoders = 0;
+	m_nExtraThreads = 0;
+	m_bExit = false;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Leave a couple of cores for the game and the engine's own job threads
+//-----------------------------------------------------------------------------
+int CVideoDecodePool::GetThreadBudget()
+{
+	if ( !m_nThreadBudget )
+	{
+		const CPUInformation& cpuInfo = *GetCPUInformation();
+		m_nThreadBudget = clamp( cpuInfo.m_nLogicalProcessors - 2, 1, 8 );
+	}
+	return m_nThreadBudget;
+}
+
+void CVideoDecodePool::AddStream( CVideoDecodeStream *pStream )
+{
+	AUTO_LOCK( m_mutex );
+	m_streams.AddToTail( pStream );
+
+	// a stream is only ever decoded on one thread at a time, so more threads than streams would just sit there
+	const int nThreads = min( GetThreadBudget(), m_streams.Count() );
+	m_bExit = false;
+	while ( m_threads.Count() < nThreads )
+		m_threads.AddToTail( CreateSimpleThread( ThreadFunc, this ) );
+}
+
+void CVideoDecodePool::RemoveStream( CVideoDecodeStream *pStream )
+{
+	m_mutex.Lock();
+	m_streams.FindAndRemove( pStream );
+
+	// a frame takes milliseconds at worst, so this won't be long
+	while ( m_claimed.HasElement( pStream ) )
+	{
+		m_mutex.Unlock();
+		ThreadSleep( 1 );
+		m_mutex.Lock();
+	}
+	m_mutex.Unlock();
+}
+
+void CVideoDecodePool::Wake()
+{
+	m_workEvent.Set();
+}
+
+void CVideoDecodePool::Shutdown()
+{
+	m_mutex.Lock();
+	m_bExit = true;
+	m_mutex.Unlock();
+
+	// every thread wakes the next on its way out
+	m_workEvent.Set();
+	FOR_EACH_VEC( m_threads, i )
+	{
+		ThreadJoin( m_threads[ i ] );
+		ReleaseThreadHandle( m_threads[ i ] );
+	}
+	m_threads.RemoveAll();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: How many streams can be decoded at once, whatever the decoders' own
+//			threads have left of the budget. Called with the lock held
+//-----------------------------------------------------------------------------
+int CVideoDecodePool::GetMaxDecodes()
+{
+	return max( GetThreadBudget() - m_nExtraThreads, 1 );
+}
+
+int CVideoDecodePool::ReserveDecoderThreads( VideoDecodePriority_t priority )
+{
+	AUTO_LOCK( m_mutex );
+	const int nBudget = GetThreadBudget();
+	// always leave the pool one decode at a time
+	const int nLeft = max( nBudget - 1 - m_nExtraThreads, 0 );
+
+	// the pool's threads already cover running several streams at once, so a decoder only
+	// gets threads of its own while there are few enough decoders to leave some spare
+	int nExtra = nLeft;
+	if ( priority != VIDEO_DECODE_PRIORITY_FULLSCREEN )
+		nExtra = min( max( nBudget / ( m_nDecoders + 1 ), 1 ) - 1, nLeft );
+
+	++m_nDecoders;
+	m_nExtraThreads += nExtra;
+	return nExtra + 1;
+}
+
+void CVideoDecodePool::ReturnDecoderThreads( int nThreads )
+{
+	m_mutex.Lock();
+	m_nExtraThreads -= nThreads;
+	Assert( m_nExtraThreads >= 0 );
+	m_mutex.Unlock();
+
+	// there may be room for another decode now
+	m_workEvent.Set();
+}
+
+void CVideoDecodePool::ReleaseDecoderThreads( int nThreads )
+{
+	m_mutex.Lock();
+	--m_nDecoders;
+	m_nExtraThreads -= nThreads - 1;
+	Assert( m_nDecoders >= 0 && m_nExtraThreads >= 0 );
+	m_mutex.Unlock();
+
+	m_workEvent.Set();
+}
+
+unsigned int CVideoDecodePool::ThreadFunc( void *params )
+{
+	( ( CVideoDecodePool * )params )->Run();
+	return 0;
+}
+
+void CVideoDecodePool::Run()
+{
+	while ( true )
+	{
+		m_mutex.Lock();
+		CVideoDecodeStream *pStream = nullptr;
+		while ( !m_bExit && ( pStream = ClaimNextStream() ) == nullptr )
+		{
+			m_mutex.Unlock();
+			m_workEvent.Wait();
+			m_mutex.Lock();
+		}
+		if ( m_bExit )
+		{
+			m_mutex.Unlock();
+			m_workEvent.Set();
+			return;
+		}
+		m_mutex.Unlock();
+
+		// the event only wakes one of us, pass it on in case there's more to do
+		m_workEvent.Set();
+
+		pStream->DecodeNext();
+
+		m_mutex.Lock();
+		m_claimed.FindAndRemove( pStream );
+		m_mutex.Unlock();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: The unclaimed stream that'll run out of frames first, fullscreen ones
+//			before anything else. Called with the lock held
+//-----------------------------------------------------------------------------
+CVideoDecodeStream *CVideoDecodePool::ClaimNextStream()
+{
+	// the decoders' own threads are busy alongside every decode that's running
+	if ( m_claimed.Count() >= GetMaxDecodes() )
+		return nullptr;
+
+	CVideoDecodeStream *pBest = nullptr;
+	double flBestSlack = 0.0;
+	FOR_EACH_VEC( m_streams, i )
+	{
+		CVideoDecodeStream *pStream = m_streams[ i ];
+		if ( m_claimed.HasElement( pStream ) || !pStream->HasWork() )
+			continue;
+
+		const double flSlack = pStream->GetSlack();
+		if ( !pBest || pStream->m_priority > pBest->m_priority ||
+			 ( pStream->m_priority == pBest->m_priority && flSlack < flBestSlack ) )
+		{
+			pBest = pStream;
+			flBestSlack = flSlack;
+		}
+	}
+
+	if ( pBest )
+		m_claimed.AddToTail( pBest );
+	return pBest;
+}
+
+//=============================================================================
+//
+// Decoder cache
+//
+//=============================================================================
+CVideoDecoderCache::CVideoDecoderCache()
+{
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Frame buffers grow to fit, so a decoder only goes to videos about the size
+//			it last decoded, rather than a small one holding onto 4K buffers
+//-----------------------------------------------------------------------------
+int CVideoDecoderCache::GetSizeClass( int width, int height )
+{
+	const int nLargest = max( width, height );
+	if ( nLargest <= 854 )
+		return 0;
+	if ( nLargest <= 1280 )
+		return 1;
+	if ( nLargest <= 1920 )
+		return 2;
+	return 3;
+}
+
+VPXDecoder *CVideoDecoderCache::Acquire( const WebMDemuxer &demuxer, unsigned int nThreads, VPXDecoder::THREAD_MODE threadMode, unsigned int nHeldFrames )
+{
+	Entry_t entry;
+	entry.pDecoder = nullptr;
+	entry.codec = demuxer.getVideoCodec();
+	entry.nThreads = nThreads;
+	entry.threadMode = threadMode;
+	entry.nHeldFrames = nHeldFrames;
+	entry.nSizeClass = GetSizeClass( demuxer.getWidth(), demuxer.getHeight() );
+
+	m_mutex.Lock();
+	// newest first, it's the most likely to still be warm
+	for ( int i = m_idle.Count() - 1; i >= 0; --i )
+	{
+		const Entry_t &idle = m_idle[ i ];
+		if ( idle.codec == entry.codec && idle.nThreads == entry.nThreads && idle.threadMode == entry.threadMode &&
+			 idle.nHeldFrames == entry.nHeldFrames && idle.nSizeClass == entry.nSizeClass )
+		{
+			entry.pDecoder = idle.pDecoder;
+			m_idle.Remove( i );
+			break;
+		}
+	}
+	m_mutex.Unlock();
+
+	if ( !entry.pDecoder )
+		entry.pDecoder = new VPXDecoder( demuxer, nThreads, threadMode, nHeldFrames );
+
+	m_mutex.Lock();
+	m_lent.AddToTail( entry );
+	m_mutex.Unlock();
+
+	return entry.pDecoder;
+}
+
+void CVideoDecoderCache::Release( VPXDecoder *pDecoder )
+{
+	if ( !pDecoder )
+		return;
+
+	m_mutex.Lock();
+	int nLent = -1;
+	FOR_EACH_VEC( m_lent, i )
+	{
+		if ( m_lent[ i ].pDecoder == pDecoder )
+		{
+			nLent = i;
+			break;
+		}
+	}
+
+	if ( nLent < 0 || !pDecoder->isOpen() )
+	{
+		if ( nLent >= 0 )
+			m_lent.Remove( nLent );
+		m_mutex.Unlock();
+		delete pDecoder;
+		return;
+	}
+
+	Entry_t entry = m_lent[ nLent ];
+	m_lent.Remove( nLent );
+	m_mutex.Unlock();
+
+	pDecoder->reset();
+
+	m_mutex.Lock();
+	m_idle.AddToTail( entry );
+	VPXDecoder *pEvicted = nullptr;
+	if ( m_idle.Count() > VIDEO_DECODER_CACHE_SIZE )
+	{
+		pEvicted = m_idle[ 0 ].pDecoder;
+		m_idle.Remove( 0 );
+	}
+	m_mutex.Unlock();
+
+	delete pEvicted;
+}
+
+void CVideoDecoderCache::Purge()
+{
+	m_mutex.Lock();
+	CUtlVector< Entry_t > idle;
+	idle.Swap( m_idle );
+	m_mutex.Unlock();
+
+	FOR_EACH_VEC( idle, i )
+		delete idle[ i ].pDecoder;
+}
@@ -0,0 +1,206 @@
+#ifndef VIDEO_DECODE_THREAD_H
+#define VIDEO_DECODE_THREAD_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/platform.h"
+#include "tier0/threadtools.h"
+#include "tier1/utlqueue.h"
+#include "tier1/utlvector.h"
+
+#include "VPXDecoder.hpp"
+
+// how many decoded frames can sit waiting ahead of the one on screen
+#define VIDEO_DECODE_READY_FRAMES 4
+// the most images the decode thread holds at once, the decoder's frame pool is sized for this
+#define VIDEO_DECODE_HELD_FRAMES ( VIDEO_DECODE_READY_FRAMES + 1 )
+
+// what the decode pool serves first, fullscreen playback always goes ahead of videos in the world
+enum VideoDecodePriority_t
+{
+	VIDEO_DECODE_PRIORITY_WORLD = 0,
+	VIDEO_DECODE_PRIORITY_FULLSCREEN,
+};
+
+struct DecodedFrame_t
+{
+	VPXDecoder::Image image; // planes are either a retained pool buffer or point into data
+	double time; // of the packet it came from, which with frame threading isn't the last one decoded
+	unsigned char *data; // only used when the decoder can't pool, e.g. VP8
+	size_t capacity;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Decodes a video's frames ahead of the playhead into a small ring, so the
+//			game thread only has to pick the one that's due and upload it. The decoding
+//			itself is done by whichever of the pool's threads gets to it
+//-----------------------------------------------------------------------------
+class CVideoDecodeStream
+{
+public:
+	// The decoder's pool has to allow for nReadyFrames + 1 held images. The ring has room for
+	// the frames in flight with frame threading as well, so the end of the stream can flush them.
+	// Without a decoder, for a file with no video track, it never has any frames
+	CVideoDecodeStream( VPXDecoder *pDecoder, VideoDecodePriority_t priority = VIDEO_DECODE_PRIORITY_WORLD, int nReadyFrames = VIDEO_DECODE_READY_FRAMES );
+	~CVideoDecodeStream();
+
+	// Takes ownership of the frame, it's deleted once decoded
+	void QueuePacket( WebMFrame *pFrame );
+	// No more packets until the next flush or loop, so the decoder can give up the frames
+	// frame threading still has in flight once everything queued is decoded
+	void QueueEndOfStream();
+	// True while there's room for more packets, queued or decoded
+	bool NeedsPackets();
+	// Anything queued, decoding, in flight in the decoder or decoded but not yet shown
+	bool HasPendingFrames();
+	// Time of the oldest frame not yet shown, false if there's nothing pending
+	bool GetNextFrameTime( double &time );
+	// Time of the last packet queued since the last flush, -1 if none
+	double GetLastQueuedTime();
+
+	// Newest decoded frame due by curTime, anything older is skipped and counted in nSkipped.
+	// What's returned stays valid until a newer frame is returned
+	const DecodedFrame_t *GetDueFrame( double curTime, int &nSkipped );
+
+	// Where playback is, frames found to be already behind this get dropped
+	void SetClock( double curTime );
+	// Frames dropped to catch up, either not decoded at all or decoded and never shown
+	int GetDroppedFrames();
+
+	// Drops everything queued, decoded and in flight, after waiting for a decode in progress
+	// to finish, so the decoder can be used directly until the next packet is queued
+	void Flush();
+
+private:
+	friend class CVideoDecodePool;
+
+	// For the pool, a packet to decode or frames to flush and somewhere to put them
+	bool HasWork();
+	// For the pool, seconds before the next frame to decode is due less what decoding one usually takes
+	double GetSlack();
+	// Decodes the next packet, only ever called on one pool thread at a time
+	void DecodeNext();
+	// Out of packets at the end of the stream, pushes out what the decoder still has in flight
+	void FlushDecoder( int generation );
+	// Moves whatever images the decoder has ready into the ring
+	void ReceiveImages( int generation );
+
+	void SkipToDueKeyFrame();
+	bool IsSuperseded();
+	void StoreImage( const VPXDecoder::Image &image, int generation );
+	void ReleaseSlot( DecodedFrame_t &slot );
+
+	VPXDecoder *m_pDecoder;
+	VideoDecodePriority_t m_priority;
+
+	// ring of decoded frames, the slot before m_nReadHead is the one on screen
+	DecodedFrame_t *m_pSlots;
+	int m_nSlots;
+	int m_nReadHead;
+	int m_nReady;
+
+	CUtlQueue< WebMFrame * > m_packets;
+	int m_nInFlight; // decoded with frame threading but no image out yet, they count against the ring
+	bool m_bEndOfStream;
+	double m_lastQueuedTime;
+	double m_clock;
+	int m_nDropped;
+	int m_nSkippedDecodes; // dropped without being decoded at all
+	int m_nDecodes;
+	double m_flDecodeTime; // spent in decode, for the pool's scheduling and working out what skipping saved
+
+	CThreadMutex m_mutex;
+	int m_nGeneration; // bumped by Flush so a decode in progress knows to throw its frame away
+	bool m_bBusy;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: The threads every video's decoding shares. One budget covers both these and
+//			the decoders' own threads, however many videos are playing, and the stream
+//			closest to running out of frames is decoded first
+//-----------------------------------------------------------------------------
+class CVideoDecodePool
+{
+public:
+	CVideoDecodePool();
+
+	// Threads start with the first stream
+	void AddStream( CVideoDecodeStream *pStream );
+	// Waits out a decode in progress, the stream isn't touched after this returns
+	void RemoveStream( CVideoDecodeStream *pStream );
+	// Something changed that may give a stream work to do
+	void Wake();
+	void Shutdown();
+
+	// Threads a new decoder should be made with, counting the pool thread its decodes run on. Every
+	// decoder gets at least that one, anything past it comes out of what the pool can run at once.
+	// Between them the pool's decodes and the decoders' own threads never go over the budget
+	int ReserveDecoderThreads( VideoDecodePriority_t priority );
+	// Gives back the threads from ReserveDecoderThreads a decoder isn't going to use
+	void ReturnDecoderThreads( int nThreads );
+	// Gives back everything ReserveDecoderThreads left the decoder with, once it's closed
+	void ReleaseDecoderThreads( int nThreads );
+
+private:
+	static unsigned int ThreadFunc( void *params );
+	void Run();
+	CVideoDecodeStream *ClaimNextStream();
+	int GetThreadBudget();
+	int GetMaxDecodes();
+
+	CUtlVector< CVideoDecodeStream * > m_streams;
+	CUtlVector< CVideoDecodeStream * > m_claimed; // being decoded by one of the threads
+	CUtlVector< ThreadHandle_t > m_threads;
+	CThreadMutex m_mutex;
+	CThreadEvent m_workEvent;
+	int m_nThreadBudget;
+	int m_nDecoders; // open decoders holding threads, including ones whose stream isn't added yet
+	int m_nExtraThreads; // reserved by those decoders past the pool thread each one's decodes run on
+	volatile bool m_bExit;
+};
+
+extern CVideoDecodePool g_VideoDecodePool;
+
+// decoders kept around once their video is done with them
+#define VIDEO_DECODER_CACHE_SIZE 3
+
+//-----------------------------------------------------------------------------
+// Purpose: Keeps decoders from finished videos to hand to new ones that want the same
+//			codec, threading and rough resolution. Setting a decoder up spins up libvpx's
+//			threads and allocates its buffers, which hitches when videos come and go
+//			with menus and screens in the world
+//-----------------------------------------------------------------------------
+class CVideoDecoderCache
+{
+public:
+	CVideoDecoderCache();
+
+	// A matching idle decoder if there is one, otherwise a new one
+	VPXDecoder *Acquire( const WebMDemuxer &demuxer, unsigned int nThreads, VPXDecoder::THREAD_MODE threadMode, unsigned int nHeldFrames );
+	// Everything it decoded has to have been released, it's reset and kept or deleted
+	void Release( VPXDecoder *pDecoder );
+	// Deletes the idle decoders
+	void Purge();
+
+private:
+	struct Entry_t
+	{
+		VPXDecoder *pDecoder;
+		WebMDemuxer::VIDEO_CODEC codec;
+		unsigned int nThreads;
+		VPXDecoder::THREAD_MODE threadMode;
+		unsigned int nHeldFrames;
+		int nSizeClass;
+	};
+
+	static int GetSizeClass( int width, int height );
+
+	CUtlVector< Entry_t > m_idle; // oldest first
+	CUtlVector< Entry_t > m_lent; // so a release knows what it's getting back
+	CThreadMutex m_mutex;
+};
+
+extern CVideoDecoderCache g_VideoDecoderCache;
+
+#endif
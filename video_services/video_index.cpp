@@ -0,0 +1,272 @@
+//===========================================================================//
+//
+// Purpose: Frame index sidecars for webm videos
+//
+//===========================================================================//
+
+#include "video_index.h"
+#include "video_reader.h"
+#include "WebMDemuxer.hpp"
+#include "tier0/dbg.h"
+#include "tier1/strtools.h"
+#include "tier1/utlbuffer.h"
+#include "filesystem.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define VIDEO_INDEX_MAGIC ( ( 'X' << 24 ) | ( 'D' << 16 ) | ( 'I' << 8 ) | 'W' )
+#define VIDEO_INDEX_VERSION 2
+
+// as they're written, without the structs' padding
+#define VIDEO_INDEX_CLUSTER_SIZE ( 2 * ( int )sizeof( int64 ) )
+#define VIDEO_INDEX_FRAME_SIZE ( ( int )sizeof( int64 ) + ( int )sizeof( int ) )
+
+static void GetIndexFileName( const char *pVideoFileName, char *pIndexFileName, int nIndexFileNameSize )
+{
+	Q_snprintf( pIndexFileName, nIndexFileNameSize, "%s" VIDEO_INDEX_EXTENSION, pVideoFileName );
+}
+
+//=============================================================================
+//
+// Frame index
+//
+//=============================================================================
+CVideoFrameIndex::CVideoFrameIndex()
+{
+}
+
+bool CVideoFrameIndex::Load( const char *pVideoFileName, const char *pPathID )
+{
+	Purge();
+
+	if ( !g_pFullFileSystem->FileExists( pVideoFileName, pPathID ) )
+		return false;
+	const int64 sourceSize = g_pFullFileSystem->Size( pVideoFileName, pPathID );
+	const int64 sourceTime = g_pFullFileSystem->GetFileTime( pVideoFileName, pPathID );
+
+	char indexFileName[ MAX_PATH ];
+	GetIndexFileName( pVideoFileName, indexFileName, sizeof( indexFileName ) );
+
+	// one shipped with the video wins over one we built ourselves
+	CUtlBuffer buf;
+	if ( !g_pFullFileSystem->ReadFile( indexFileName, pPathID, buf ) &&
+		 !g_pFullFileSystem->ReadFile( indexFileName, VIDEO_INDEX_WRITE_PATH, buf ) )
+		return false;
+
+	if ( buf.GetBytesRemaining() < 4 * ( int )sizeof( int ) + 2 * ( int )sizeof( int64 ) || buf.GetInt() != VIDEO_INDEX_MAGIC || buf.GetInt() != VIDEO_INDEX_VERSION )
+		return false;
+
+	// the video has changed since this was built
+	if ( buf.GetInt64() != sourceSize || buf.GetInt64() != sourceTime )
+	{
+		DevMsg( "Frame index for %s is out of date\n", pVideoFileName );
+		return false;
+	}
+
+	// the counts come from the file, so keep them to what could fit before multiplying them up
+	const int nClusters = buf.GetInt();
+	const int nFrames = buf.GetInt();
+	const int nRemaining = buf.GetBytesRemaining();
+	if ( nClusters < 0 || nFrames <= 0 || nClusters > nRemaining / VIDEO_INDEX_CLUSTER_SIZE || nFrames > nRemaining / VIDEO_INDEX_FRAME_SIZE ||
+		 ( int64 )nRemaining != ( int64 )nClusters * VIDEO_INDEX_CLUSTER_SIZE + ( int64 )nFrames * VIDEO_INDEX_FRAME_SIZE )
+		return false;
+
+	m_clusters.SetCount( nClusters );
+	for ( int i = 0; i < nClusters; ++i )
+	{
+		m_clusters[ i ].pos = buf.GetInt64();
+		m_clusters[ i ].time = buf.GetInt64();
+	}
+
+	m_frames.SetCount( nFrames );
+	for ( int i = 0; i < nFrames; ++i )
+	{
+		m_frames[ i ].time = buf.GetInt64();
+		m_frames[ i ].flags = buf.GetInt();
+	}
+
+	return true;
+}
+
+bool CVideoFrameIndex::Save( const char *pVideoFileName, const char *pPathID ) const
+{
+	if ( !IsValid() || !g_pFullFileSystem->FileExists( pVideoFileName, pPathID ) )
+		return false;
+
+	CUtlBuffer buf;
+	buf.PutInt( VIDEO_INDEX_MAGIC );
+	buf.PutInt( VIDEO_INDEX_VERSION );
+	buf.PutInt64( g_pFullFileSystem->Size( pVideoFileName, pPathID ) );
+	buf.PutInt64( g_pFullFileSystem->GetFileTime( pVideoFileName, pPathID ) );
+	buf.PutInt( m_clusters.Count() );
+	buf.PutInt( m_frames.Count() );
+
+	FOR_EACH_VEC( m_clusters, i )
+	{
+		buf.PutInt64( m_clusters[ i ].pos );
+		buf.PutInt64( m_clusters[ i ].time );
+	}
+
+	FOR_EACH_VEC( m_frames, i )
+	{
+		buf.PutInt64( m_frames[ i ].time );
+		buf.PutInt( m_frames[ i ].flags );
+	}
+
+	char indexFileName[ MAX_PATH ];
+	GetIndexFileName( pVideoFileName, indexFileName, sizeof( indexFileName ) );
+
+	char indexDir[ MAX_PATH ];
+	Q_strncpy( indexDir, indexFileName, sizeof( indexDir ) );
+	Q_StripFilename( indexDir );
+	if ( indexDir[ 0 ] )
+		g_pFullFileSystem->CreateDirHierarchy( indexDir, VIDEO_INDEX_WRITE_PATH );
+
+	if ( !g_pFullFileSystem->WriteFile( indexFileName, VIDEO_INDEX_WRITE_PATH, buf ) )
+	{
+		DevMsg( "Couldn't write frame index %s\n", indexFileName );
+		return false;
+	}
+	return true;
+}
+
+void CVideoFrameIndex::Purge()
+{
+	m_frames.Purge();
+	m_clusters.Purge();
+}
+
+void CVideoFrameIndex::Swap( CVideoFrameIndex &other )
+{
+	m_frames.Swap( other.m_frames );
+	m_clusters.Swap( other.m_clusters );
+}
+
+void CVideoFrameIndex::AddCluster( int64 pos, int64 time )
+{
+	Cluster_t &cluster = m_clusters[ m_clusters.AddToTail() ];
+	cluster.pos = pos;
+	cluster.time = time;
+}
+
+void CVideoFrameIndex::AddFrame( int64 time, bool bKey )
+{
+	Frame_t &frame = m_frames[ m_frames.AddToTail() ];
+	frame.time = time;
+	frame.flags = bKey ? FRAME_KEY : 0;
+}
+
+double CVideoFrameIndex::GetFrameRate() const
+{
+	const int count = m_frames.Count();
+	if ( count < 2 )
+		return 0.0;
+
+	const int64 span = m_frames[ count - 1 ].time - m_frames[ 0 ].time;
+	if ( span <= 0 )
+		return 0.0;
+
+	return ( count - 1 ) / ( span / 1e9 );
+}
+
+int CVideoFrameIndex::FindFrame( int64 time_ns ) const
+{
+	// frames are in decode order, which for webm is presentation order too
+	int lo = 0;
+	int hi = m_frames.Count() - 1;
+	if ( hi < 0 || time_ns < m_frames[ 0 ].time )
+		return 0;
+
+	while ( lo < hi )
+	{
+		const int mid = ( lo + hi + 1 ) / 2;
+		if ( m_frames[ mid ].time <= time_ns )
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+int CVideoFrameIndex::FindKeyFrame( int nFrame ) const
+{
+	nFrame = clamp( nFrame, 0, m_frames.Count() - 1 );
+	while ( nFrame > 0 && !( m_frames[ nFrame ].flags & FRAME_KEY ) )
+		--nFrame;
+	return nFrame;
+}
+
+const CVideoFrameIndex::Cluster_t *CVideoFrameIndex::FindCluster( int64 time_ns ) const
+{
+	int lo = 0;
+	int hi = m_clusters.Count() - 1;
+	if ( hi < 0 || time_ns < m_clusters[ 0 ].time )
+		return nullptr;
+
+	while ( lo < hi )
+	{
+		const int mid = ( lo + hi + 1 ) / 2;
+		if ( m_clusters[ mid ].time <= time_ns )
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return &m_clusters[ lo ];
+}
+
+//=============================================================================
+//
+// Background builder
+//
+//=============================================================================
+CVideoIndexBuilder::CVideoIndexBuilder( const char *pVideoFileName, const char *pPathID )
+{
+	Q_strncpy( m_fileName, pVideoFileName, sizeof( m_fileName ) );
+	m_bHasPathID = pPathID != nullptr;
+	Q_strncpy( m_pathID, pPathID ? pPathID : "", sizeof( m_pathID ) );
+
+	m_bCancel = false;
+	m_bDone = false;
+	m_hThread = CreateSimpleThread( ThreadFunc, this );
+}
+
+CVideoIndexBuilder::~CVideoIndexBuilder()
+{
+	m_bCancel = true;
+	if ( m_hThread )
+	{
+		ThreadJoin( m_hThread );
+		ReleaseThreadHandle( m_hThread );
+	}
+}
+
+unsigned int CVideoIndexBuilder::ThreadFunc( void *params )
+{
+	( ( CVideoIndexBuilder * )params )->Run();
+	return 0;
+}
+
+void CVideoIndexBuilder::Run()
+{
+	const char *pPathID = m_bHasPathID ? m_pathID : nullptr;
+
+	// our own reader and demuxer, the ones playing the video aren't thread safe
+	if ( CVideoReader *pReader = CreateVideoReader( m_fileName, pPathID ) )
+	{
+		{
+			WebMDemuxer demuxer( pReader );
+			if ( !demuxer.isOpen() || !demuxer.buildIndex( m_index, &m_bCancel ) )
+				m_index.Purge();
+		}
+		delete pReader;
+	}
+
+	if ( m_index.IsValid() )
+	{
+		DevMsg( "Built frame index for %s, %d frames\n", m_fileName, m_index.GetFrameCount() );
+		m_index.Save( m_fileName, pPathID );
+	}
+
+	m_bDone = true;
+}
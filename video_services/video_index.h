@@ -0,0 +1,113 @@
+#ifndef VIDEO_INDEX_H
+#define VIDEO_INDEX_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/platform.h"
+#include "tier0/threadtools.h"
+#include "tier1/utlvector.h"
+
+// sidecar is the video's name with this tacked on, e.g. media/intro.webm.webmidx
+#define VIDEO_INDEX_EXTENSION ".webmidx"
+// sidecars we build go here, ones shipped with the video are looked for next to it first
+#define VIDEO_INDEX_WRITE_PATH "DEFAULT_WRITE_PATH"
+
+//-----------------------------------------------------------------------------
+// Purpose: Every video frame's time and every cluster's position, so the frame count,
+//			framerate and where to seek to for any frame are known without walking the clusters
+//-----------------------------------------------------------------------------
+class CVideoFrameIndex
+{
+public:
+	enum
+	{
+		FRAME_KEY = ( 1 << 0 ),
+	};
+
+	struct Frame_t
+	{
+		int64 time;		// ns
+		int flags;
+	};
+
+	struct Cluster_t
+	{
+		int64 pos;		// relative to the segment, as mkvparser keeps them
+		int64 time;		// ns
+	};
+
+	CVideoFrameIndex();
+
+	// Reads the sidecar and checks it was built from the file as it is now
+	bool Load( const char *pVideoFileName, const char *pPathID );
+	bool Save( const char *pVideoFileName, const char *pPathID ) const;
+
+	void Purge();
+	void Swap( CVideoFrameIndex &other );
+
+	void AddCluster( int64 pos, int64 time );
+	void AddFrame( int64 time, bool bKey );
+
+	bool IsValid() const
+	{
+		return m_frames.Count() > 0;
+	}
+	int GetFrameCount() const
+	{
+		return m_frames.Count();
+	}
+	const Frame_t &GetFrame( int nFrame ) const
+	{
+		return m_frames[ nFrame ];
+	}
+
+	double GetFrameRate() const;
+	// Last frame at or before time_ns
+	int FindFrame( int64 time_ns ) const;
+	// Last keyframe at or before nFrame
+	int FindKeyFrame( int nFrame ) const;
+	// Last cluster starting at or before time_ns
+	const Cluster_t *FindCluster( int64 time_ns ) const;
+
+private:
+	CUtlVector< Frame_t > m_frames;
+	CUtlVector< Cluster_t > m_clusters;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Builds an index for a video on its own thread through its own reader,
+//			then writes the sidecar so the next open doesn't need to
+//-----------------------------------------------------------------------------
+class CVideoIndexBuilder
+{
+public:
+	CVideoIndexBuilder( const char *pVideoFileName, const char *pPathID );
+	// Stops the build if it's still going
+	~CVideoIndexBuilder();
+
+	bool IsDone() const
+	{
+		return m_bDone;
+	}
+	// Only safe once IsDone
+	CVideoFrameIndex &GetIndex()
+	{
+		return m_index;
+	}
+
+private:
+	static unsigned int ThreadFunc( void *params );
+	void Run();
+
+	CVideoFrameIndex m_index;
+	char m_fileName[ MAX_PATH ];
+	char m_pathID[ MAX_PATH ];
+	bool m_bHasPathID;
+
+	ThreadHandle_t m_hThread;
+	volatile bool m_bCancel;
+	volatile bool m_bDone;
+};
+
+#endif
@@ -9,8 +9,10 @@
 #include "video_material.h"
 #include "video_services.h"
 #include "materialsystem/imaterial.h"
+#include "materialsystem/imaterialvar.h"
 #include "filesystem.h"
 #include "tier0/platform.h"
+#include "tier0/icommandline.h"
 #include "tier1/KeyValues.h"
 #include "tier1/utlbuffer.h"
 
@@ -19,9 +21,19 @@
 
 // about a second
 #define BUFFER_SIZE 196608
-// at minimim accomdate about an update every 125ms
-#define BUFFER_FILLED_MIN 4096 * 16
+// how much sound the feed thread keeps decoded ahead of the device, in seconds
+#define AUDIO_AHEAD_TIME 0.25
+// how often the feed thread looks when nothing wakes it, in ms
+#define FEED_INTERVAL 10
 #define FREEZE_TIME 0.125
+// the clock jumps to the sound when they're further apart than this, in seconds
+#define AV_SYNC_SNAP 0.2
+// otherwise it runs up to this much faster or slower until it's caught up
+#define AV_SYNC_SLEW 0.05
+// a material this close to the start can still share with one opened for the same file
+#define SHARE_START_WINDOW 0.1
+// frame times come from integer timecodes, so allow a little slack when landing on a seek target
+#define SEEK_TOLERANCE 0.0005
 
 //=============================================================================
 // 
@@ -57,6 +69,8 @@ void CYUVTextureRegenerator<Channel>::RegenerateTextureBits( ITexture *pTexture,
 // 
 //=============================================================================
 
+CInterlockedInt CVideoMaterial::s_nAbandonedLoads;
+
 //-----------------------------------------------------------------------------
 // Purpose: a paranoid amount of initialisation
 //-----------------------------------------------------------------------------
@@ -64,11 +78,19 @@ CVideoMaterial::CVideoMaterial()
 {
 	m_mkvReader = nullptr;
 	m_demuxer = nullptr;
+	m_pIndexBuilder = nullptr;
+	m_pDecodeStream = nullptr;
+	m_pShareOwner = nullptr;
+	m_nUpdates = 0;
+	m_nOwnerUpdatesSeen = 0;
+	m_bLastUpdate = false;
 	m_videoDecoder = nullptr;
+	m_nDecoderThreads = 0;
 	m_audioDecoder = nullptr;
 	m_audioFrame = new WebMFrame();
 	m_image = new VPXDecoder::Image();
 	m_pcm = nullptr;
+	m_bFloatPCM = false;
 
 	m_videoWidth = 0;
 	m_videoHeight = 0;
@@ -85,11 +107,38 @@ CVideoMaterial::CVideoMaterial()
 	m_soundKilled = false;
 
 	m_videoPath[0] = '\0';
+	m_materialName[0] = '\0';
+	m_pathID[0] = '\0';
+	m_bHasPathID = false;
+	m_pSoundDevice = nullptr;
+	m_priority = VIDEO_DECODE_PRIORITY_WORLD;
+
+	m_hFeedThread = nullptr;
+	m_bFeedExit = false;
+	m_nFeedTicks = 0;
+	m_feedClock = 0.0;
+	m_bReadEnded = false;
+
+	m_hLoadThread = nullptr;
+	m_nLoadState = LOAD_DONE;
+	m_bLoadSucceeded = false;
+	m_bFirstImageHeld = false;
 
 	m_volume = 1.0f;
 	m_videoTime = 0.0;
 	m_curTime = 0.0;
-	m_prevTicks = 0;
+	m_loopPeriod = 0.0;
+	m_passOffset = 0.0;
+	m_shownPassStart = 0.0;
+	m_passVideoEnd = -1.0;
+	m_passAudioStart = -1.0;
+	m_passAudioEnd = -1.0;
+	m_bAudioPassStart = false;
+	m_prevTime = 0.0;
+	m_audioEndTime = -1.0;
+	m_avOffsetTotal = 0.0;
+	m_avOffsetWorst = 0.0;
+	m_nAVOffsets = 0;
 
 	m_currentFrame = 0;
 
@@ -108,6 +157,13 @@ CVideoMaterial::CVideoMaterial()
 	m_pAudioBuffer = nullptr;
 #ifdef _LINUX
 	m_pSDLAudioStream = nullptr;
+	m_bAudioRingFull = false;
+	m_nAudioOverruns = 0;
+	m_bAudioStarved = false;
+	m_nAudioUnderruns = 0;
+	m_flAudioReadTime = 0.0;
+	m_nAudioRingReady = 0;
+	m_nAudioReaders = 0;
 #elif _WIN32
 	m_directSoundNotify = nullptr;
 	m_endEventHandle = nullptr;
@@ -118,9 +174,24 @@ CVideoMaterial::CVideoMaterial()
 
 CVideoMaterial::~CVideoMaterial()
 {
+	// anything still loading goes through Destroy
+	Assert( !m_hLoadThread );
+
+	// whoever shows our frames needs a decoder of their own now
+	ReleaseFollowers();
+	if ( m_pShareOwner )
+	{
+		m_pShareOwner->m_shareFollowers.FindAndRemove( this );
+		m_pShareOwner->ApplyVolume();
+	}
+
 	m_videoEnded = true;
 	m_videoStopped = true;
-	m_videoFrames.Purge();
+
+	// stop reading and decoding before anything it uses goes away
+	StopFeeding();
+	delete m_pDecodeStream;
+	delete m_pIndexBuilder;
 
 	DestroySoundBuffer();
 
@@ -153,8 +224,9 @@ CVideoMaterial::~CVideoMaterial()
 
 	IMaterial* material = m_videoMaterial;
 	m_videoMaterial.Shutdown();
-	// Removes any material that might reference the video texture
-	if( materials )
+	// Removes any material that might reference the video texture. There's none if we never got as far
+	// as making one, which is always the case when an abandoned load is freed on its own thread
+	if( material && materials )
 		materials->UncacheUnusedMaterials();
 
 	// kill it if it remains
@@ -170,21 +242,143 @@ CVideoMaterial::~CVideoMaterial()
 		CloseHandle( m_videoOverEventHandle );
 #endif
 
-	delete m_pcm;
+	delete[] m_pcm;
+	// the poster may still hold a pool buffer, hand it back while the image is alive. The decode
+	// stream has let go of every other frame by now, so the next video can have the decoder
+	if ( m_bFirstImageHeld )
+	{
+		m_videoDecoder->releaseImage( *m_image );
+		m_bFirstImageHeld = false;
+	}
 	delete m_image;
 	delete m_audioDecoder;
-	delete m_videoDecoder;
+	if ( m_videoDecoder )
+		g_VideoDecoderCache.Release( m_videoDecoder );
+	if ( m_nDecoderThreads > 0 )
+		g_VideoDecodePool.ReleaseDecoderThreads( m_nDecoderThreads );
 	delete m_demuxer;
 	delete m_mkvReader;
 
 	delete m_audioFrame;
+	PurgeAudioPackets();
 	delete m_pAudioBuffer;
 }
 
-bool CVideoMaterial::LoadVideo( const char *pMaterialName, const char *pVideoFileName, void *pSoundDevice )
+bool CVideoMaterial::LoadVideo( const char *pMaterialName, const char *pVideoFileName, const char *pPathID, void *pSoundDevice, VideoDecodePriority_t priority, bool bAsync )
 {
 	Q_strncpy( m_videoPath, pVideoFileName, sizeof( m_videoPath ) );
-	m_mkvReader = new MkvReader( m_videoPath );
+	Q_strncpy( m_materialName, pMaterialName, sizeof( m_materialName ) );
+	m_bHasPathID = pPathID != nullptr;
+	Q_strncpy( m_pathID, pPathID ? pPathID : "", sizeof( m_pathID ) );
+	m_pSoundDevice = pSoundDevice;
+	m_priority = priority;
+
+	if ( bAsync )
+	{
+		m_nLoadState = LOAD_RUNNING;
+		m_hLoadThread = CreateSimpleThread( LoadThreadFunc, this );
+		if ( m_hLoadThread )
+			return true;
+	}
+
+	if ( !OpenVideo() )
+		return false;
+
+	DecodeFirstFrame();
+	return FinishLoad();
+}
+
+unsigned int CVideoMaterial::LoadThreadFunc( void *params )
+{
+	CVideoMaterial *pMaterial = ( CVideoMaterial * )params;
+	pMaterial->m_bLoadSucceeded = pMaterial->OpenVideo();
+	if ( pMaterial->m_bLoadSucceeded )
+		pMaterial->DecodeFirstFrame();
+
+	// destroyed while we were at it, nobody is going to pick this up so it's ours to free
+	if ( !pMaterial->m_nLoadState.AssignIf( LOAD_RUNNING, LOAD_DONE ) )
+	{
+		delete pMaterial;
+		--s_nAbandonedLoads;
+	}
+	return 0;
+}
+
+void CVideoMaterial::Destroy()
+{
+	// there's no stopping an open halfway, but there's no need to wait for it either
+	if ( m_hLoadThread )
+	{
+		ThreadDetach( m_hLoadThread );
+		ReleaseThreadHandle( m_hLoadThread );
+		m_hLoadThread = nullptr;
+
+		++s_nAbandonedLoads;
+		if ( m_nLoadState.AssignIf( LOAD_RUNNING, LOAD_ABANDONED ) )
+			return;
+		--s_nAbandonedLoads;
+	}
+	delete this;
+}
+
+void CVideoMaterial::WaitForAbandonedLoads()
+{
+	// what they free goes back to the decode pool and cache, so they have to be done before those are
+	while ( s_nAbandonedLoads > 0 )
+		ThreadSleep( 1 );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Picks up an async load once its thread is done, on the main thread
+//			because that's where the textures and material have to be made
+//-----------------------------------------------------------------------------
+void CVideoMaterial::CheckLoad()
+{
+	if ( !m_hLoadThread || m_nLoadState != LOAD_DONE )
+		return;
+
+	ThreadJoin( m_hLoadThread );
+	ReleaseThreadHandle( m_hLoadThread );
+	m_hLoadThread = nullptr;
+
+	if ( !m_bLoadSucceeded )
+	{
+		Warning( "Couldn't open video %s\n", m_videoPath );
+		return;
+	}
+	FinishLoad();
+}
+
+bool CVideoMaterial::IsLoading() const
+{
+	return m_hLoadThread != nullptr;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Everything past opening the file and decoding the first frame
+//-----------------------------------------------------------------------------
+bool CVideoMaterial::FinishLoad()
+{
+	// what DecodeFirstFrame kept of the sound is only ever taken off the queue by NeedAudio
+	if ( !CreateSoundBuffer( m_pSoundDevice ) || !m_pAudioBuffer )
+		PurgeAudioPackets();
+	CreateVideoTextures( m_materialName );
+	CreateVideoMaterial( m_materialName, this );
+	ShowFirstFrame();
+
+	// first frame is decoded and up, everything from here is decoded ahead on the pool
+	m_pDecodeStream = new CVideoDecodeStream( m_videoDecoder, m_priority );
+	StartFeeding();
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Opens the file along with everything needed to decode it and play its sound
+//-----------------------------------------------------------------------------
+bool CVideoMaterial::OpenVideo()
+{
+	const char *pPathID = m_bHasPathID ? m_pathID : nullptr;
+	m_mkvReader = CreateVideoReader( m_videoPath, pPathID );
 	if ( !m_mkvReader )
 		return false;
 
@@ -201,24 +395,59 @@ bool CVideoMaterial::LoadVideo( const char *pMaterialName, const char *pVideoFil
 		return false;
 	}
 	
-	// assign the decoder a reasonable number of threads
-	const CPUInformation& cpuInfo = *GetCPUInformation();
-	unsigned int numthreads = clamp( cpuInfo.m_nLogicalProcessors - 2, 1, 8 );
-	m_videoDecoder = new VPXDecoder( *m_demuxer, numthreads );
+	// assign the decoder its share of the decode budget, but no more than the stream's
+	// layout can keep busy. VP9 tile threading can't use more threads than tile columns
+	unsigned int numthreads = 1;
+	VPXDecoder::THREAD_MODE threadMode = VPXDecoder::THREAD_TILES;
+	if ( m_demuxer->getVideoCodec() != WebMDemuxer::NO_VIDEO )
+	{
+		m_nDecoderThreads = g_VideoDecodePool.ReserveDecoderThreads( m_priority );
+		numthreads = m_nDecoderThreads;
+
+		WebMFrame keyFrame;
+		VPXDecoder::StreamInfo streamInfo;
+		while ( m_demuxer->readFrame( &keyFrame, nullptr ) && !keyFrame.key )
+			;
+		m_demuxer->resetVideo();
+
+		if ( keyFrame.key && VPXDecoder::getStreamInfo( keyFrame, m_demuxer->getVideoCodec(), streamInfo ) )
+		{
+			// frame threading trades a few frames of latency after every seek and loop for throughput
+			const bool bFrameThreads = CommandLine()->CheckParm( "-videoframethreads" ) != nullptr;
+			numthreads = max( VPXDecoder::pickThreads( m_demuxer->getVideoCodec(), streamInfo, numthreads, threadMode, bFrameThreads ), 1u );
+
+			// what the layout can't use goes back for the next video, the decoder keeps at least one until it's closed
+			g_VideoDecodePool.ReturnDecoderThreads( m_nDecoderThreads - numthreads );
+			m_nDecoderThreads = numthreads;
+			DevMsg( "%s: %dx%d tiles, decoding with %u threads (%s)\n", m_videoPath, streamInfo.columnTiles, streamInfo.rowTiles, numthreads,
+				threadMode == VPXDecoder::THREAD_ROWS ? "rows" : threadMode == VPXDecoder::THREAD_FRAMES ? "frames" : "tiles" );
+		}
+	}
+	// a file with only sound plays it with no decoder, textures or frames
+	if ( m_demuxer->getVideoCodec() != WebMDemuxer::NO_VIDEO )
+	{
+		m_videoDecoder = g_VideoDecoderCache.Acquire( *m_demuxer, numthreads, threadMode, VIDEO_DECODE_HELD_FRAMES );
+		m_videoWidth = m_demuxer->getWidth();
+		m_videoHeight = m_demuxer->getHeight();
+	}
 	m_audioDecoder = new OpusVorbisDecoder( *m_demuxer );
-	m_pcm = m_audioDecoder->isOpen() ? new short[m_audioDecoder->getBufferSamples() * m_demuxer->getChannels()] : NULL;
-	m_videoWidth = m_demuxer->getWidth();
-	m_videoHeight = m_demuxer->getHeight();
-	// This is a guessed framerate from the first 50 frames 
-	m_frameRate.SetFPS( m_demuxer->getFrameRate() ); 
+	m_pcm = m_audioDecoder->isOpen() ? new unsigned char[m_audioDecoder->getBufferSamples() * m_demuxer->getChannels() * sizeof( float )] : NULL;
 
-	CreateSoundBuffer( pSoundDevice );
-	CreateVideoMaterial( pMaterialName );
+	// with an index the framerate is exact and seeks go straight to the right cluster,
+	// without one build it in the background for next time
+	if ( m_frameIndex.Load( m_videoPath, pPathID ) )
+		m_demuxer->setIndex( &m_frameIndex );
+	else if ( m_demuxer->getVideoCodec() != WebMDemuxer::NO_VIDEO )
+		m_pIndexBuilder = new CVideoIndexBuilder( m_videoPath, pPathID );
+
+	// This is a guessed framerate from the first 50 frames unless we have an index
+	m_frameRate.SetFPS( m_demuxer->getFrameRate() ); 
 	return true;
 }
 
 bool CVideoMaterial::CreateSoundBuffer( void* pSoundDevice )
 {
+	AUTO_LOCK( m_feedMutex );
 	if ( !m_audioDecoder->isOpen() )
 		return false;
 
@@ -229,6 +458,10 @@ bool CVideoMaterial::CreateSoundBuffer( void* pSoundDevice )
 	}
 
 #ifdef _LINUX
+	// the callback may already be running for the other sounds, keep it off the ring
+	// and everything it reads with until they're made
+	SuspendAudioRing();
+
 	// todo; Error checking
 
 	// this is a copy recieved from services so we don't need to allocate it
@@ -248,8 +481,16 @@ bool CVideoMaterial::CreateSoundBuffer( void* pSoundDevice )
 	else
 	{
 		m_pAudioBuffer = new Uint8[ m_pAudioDevice->size ];
-		m_pSDLAudioStream = SDL_NewAudioStream( AUDIO_S16, m_demuxer->getChannels(), m_demuxer->getSampleRate(),
+		// a float device gets the decoder's float as it is, rather than it going to S16
+		// and the stream taking it back again
+		m_bFloatPCM = SDL_AUDIO_ISFLOAT( m_pAudioDevice->format );
+		m_pSDLAudioStream = SDL_NewAudioStream( m_bFloatPCM ? AUDIO_F32SYS : AUDIO_S16SYS, m_demuxer->getChannels(), m_demuxer->getSampleRate(),
 		m_pAudioDevice->format, m_pAudioDevice->channels, m_pAudioDevice->freq );
+		m_audioRing.Init( BUFFER_SIZE );
+		m_bAudioRingFull = false;
+		m_bAudioStarved = false;
+		m_soundKilled = false;
+		m_nAudioRingReady = 1;
 	}
 
 	return true;
@@ -280,6 +521,7 @@ bool CVideoMaterial::CreateSoundBuffer( void* pSoundDevice )
 
 	m_nAudioBufferSize = BUFFER_SIZE;
 	m_nBytesPerSample = waveFormat.nBlockAlign;
+	m_bFloatPCM = false;
 
 	IDirectSoundBuffer* tempBuffer = nullptr;
 	if ( FAILED( IDirectSound_CreateSoundBuffer( m_pAudioDevice, &dsbd, &tempBuffer, NULL ) ) )
@@ -316,16 +558,20 @@ bool CVideoMaterial::CreateSoundBuffer( void* pSoundDevice )
 	return true;
 }
 
-void CVideoMaterial::CreateVideoMaterial( const char* pMaterialName )
+//-----------------------------------------------------------------------------
+// Purpose: The Y, Cb and Cr textures decoded frames get uploaded to
+//-----------------------------------------------------------------------------
+void CVideoMaterial::CreateVideoTextures( const char *pTextureName )
 {
-	// ---------------------------
-	// texture
+	if ( !m_videoDecoder )
+		return;
+
 	char ytexture[ MAX_PATH ];
-	Q_snprintf( ytexture, MAX_PATH, "%s_y", pMaterialName );
+	Q_snprintf( ytexture, MAX_PATH, "%s_y", pTextureName );
 	char crtexture[ MAX_PATH ];
-	Q_snprintf( crtexture, MAX_PATH, "%s_cr", pMaterialName );
+	Q_snprintf( crtexture, MAX_PATH, "%s_cr", pTextureName );
 	char cbtexture[ MAX_PATH ];
-	Q_snprintf( cbtexture, MAX_PATH, "%s_cb", pMaterialName );
+	Q_snprintf( cbtexture, MAX_PATH, "%s_cb", pTextureName );
 
 	int tex_flags = TEXTUREFLAGS_CLAMPS | TEXTUREFLAGS_CLAMPT | TEXTUREFLAGS_PROCEDURAL |
 		TEXTUREFLAGS_NOMIP | TEXTUREFLAGS_NOLOD | TEXTUREFLAGS_SINGLECOPY;
@@ -346,15 +592,22 @@ void CVideoMaterial::CreateVideoMaterial( const char* pMaterialName )
 	m_yTexture->SetTextureRegenerator( m_yTextureRegen );
 	m_crTexture->SetTextureRegenerator( m_crTextureRegen );
 	m_cbTexture->SetTextureRegenerator( m_cbTextureRegen );
+}
 
-	// ---------------------------
-	// material
-	// 
+//-----------------------------------------------------------------------------
+// Purpose: The material showing pTextureOwner's textures, which are our own unless
+//			we're showing another material's frames
+//-----------------------------------------------------------------------------
+void CVideoMaterial::CreateVideoMaterial( const char *pMaterialName, CVideoMaterial *pTextureOwner )
+{
 	// Use the Bik shader as it deals with YUV420
 	KeyValues* pVMTKeyValues = new KeyValues( "Bik" );
-	pVMTKeyValues->SetString( "$ytexture", ytexture );
-	pVMTKeyValues->SetString( "$cbtexture", cbtexture );
-	pVMTKeyValues->SetString( "$crtexture", crtexture );
+	if ( pTextureOwner->m_yTexture.IsValid() )
+	{
+		pVMTKeyValues->SetString( "$ytexture", pTextureOwner->m_yTexture->GetName() );
+		pVMTKeyValues->SetString( "$cbtexture", pTextureOwner->m_cbTexture->GetName() );
+		pVMTKeyValues->SetString( "$crtexture", pTextureOwner->m_crTexture->GetName() );
+	}
 	pVMTKeyValues->SetInt( "$nofog", 1 );
 	pVMTKeyValues->SetInt( "$spriteorientation", 3 );
 	pVMTKeyValues->SetInt( "$translucent", 1 );
@@ -370,30 +623,247 @@ void CVideoMaterial::CreateVideoMaterial( const char* pMaterialName )
 
 	m_videoReady = true;
 	m_videoStarted = false;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Decodes the first frame of the video into m_image, held onto until
+//			ShowFirstFrame has it uploaded. The decoder and demuxer are left where
+//			they are so playback picks up from the next packet instead of decoding it twice
+//-----------------------------------------------------------------------------
+void CVideoMaterial::DecodeFirstFrame()
+{
+	// nothing to show, and the sound is read from the start by the feed thread
+	if ( !m_videoDecoder )
+	{
+		Q_memset( m_image, 0, sizeof( *m_image ) );
+		return;
+	}
 
-	// update the procedural texture with the first frame of the video
 	WebMFrame video_frame;
 	VPXDecoder::Image image;
-	while ( m_demuxer->readFrame( &video_frame, nullptr ) )
+	bool bDecoded = false;
+	// sound that's muxed ahead of the first frame would be skipped over otherwise. The sound buffer
+	// isn't made until FinishLoad, so only keep it if there's a device for one to be made for
+	const bool bHasAudio = m_audioDecoder && m_audioDecoder->isOpen() && m_pSoundDevice;
+	WebMFrame *pAudioFrame = bHasAudio ? new WebMFrame() : nullptr;
+	while ( m_demuxer->readFrame( &video_frame, pAudioFrame ) )
 	{
-		if ( !m_videoDecoder->decode( video_frame ) )
+		if ( pAudioFrame && pAudioFrame->isValid() )
+		{
+			m_audioPackets.Insert( pAudioFrame );
+			pAudioFrame = new WebMFrame();
+		}
+
+		if ( !video_frame.isValid() || !m_videoDecoder->decode( video_frame ) )
 			continue;
 
 		if ( m_videoDecoder->getImage( image ) == VPXDecoder::IMAGE_ERROR::NO_IMAGE_ERROR )
 		{
-			m_yTextureRegen->m_decodedImage = &image;
-			m_crTextureRegen->m_decodedImage = &image;
-			m_cbTextureRegen->m_decodedImage = &image;
+			*m_image = image;
+			bDecoded = true;
+			break;
+		}
+	}
+	delete pAudioFrame;
 
-			m_yTexture->Download();
-			m_crTexture->Download();
-			m_cbTexture->Download();
+	// held until it's uploaded, which for an async load is whenever the main thread gets to it
+	if ( bDecoded )
+		m_bFirstImageHeld = m_videoDecoder->retainImage( *m_image );
 
-			break;
+	// with frame threading a short enough video can run out before anything comes out. Draining
+	// throws away the frames after the poster, so playback has to decode them again from the start
+	bool bRestart = !bDecoded;
+	if ( m_videoDecoder->getFramesDelay() > 0 && m_videoDecoder->flush() )
+	{
+		VPXDecoder::IMAGE_ERROR err;
+		while ( ( err = m_videoDecoder->getImage( image ) ) != VPXDecoder::IMAGE_ERROR::NO_FRAME )
+		{
+			if ( !bDecoded && err == VPXDecoder::IMAGE_ERROR::NO_IMAGE_ERROR )
+			{
+				*m_image = image;
+				bDecoded = true;
+				m_bFirstImageHeld = m_videoDecoder->retainImage( *m_image );
+			}
 		}
+		bRestart = true;
 	}
 
-	m_demuxer->resetVideo();
+	if ( !bDecoded )
+		Q_memset( m_image, 0, sizeof( *m_image ) );
+
+	// otherwise the decoder is left just past the poster frame and playback carries on from the next packet
+	if ( bRestart )
+	{
+		PurgeAudioPackets();
+		m_demuxer->resetVideo();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Updates the procedural textures with the first frame of the video
+//-----------------------------------------------------------------------------
+void CVideoMaterial::ShowFirstFrame()
+{
+	if ( m_image->planes[ 0 ] )
+		UploadImage( m_image );
+
+	if ( m_bFirstImageHeld )
+	{
+		m_videoDecoder->releaseImage( *m_image );
+		m_bFirstImageHeld = false;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Points the texture regenerators at a decoded image and downloads it
+//-----------------------------------------------------------------------------
+void CVideoMaterial::UploadImage( const VPXDecoder::Image *pImage )
+{
+	m_yTextureRegen->m_decodedImage = pImage;
+	m_crTextureRegen->m_decodedImage = pImage;
+	m_cbTextureRegen->m_decodedImage = pImage;
+
+	m_yTexture->Download();
+	m_crTexture->Download();
+	m_cbTexture->Download();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: True if a material for the same file could show our frames instead of
+//			decoding its own. That only holds near the start, which is where the new
+//			one would be playing from
+//-----------------------------------------------------------------------------
+bool CVideoMaterial::CanShare( const char *pVideoFileName, const char *pPathID ) const
+{
+	if ( m_pShareOwner || !m_videoReady || m_videoStopped || m_priority != VIDEO_DECODE_PRIORITY_WORLD )
+		return false;
+
+	if ( m_curTime > SHARE_START_WINDOW )
+		return false;
+
+	if ( m_bHasPathID != ( pPathID != nullptr ) || ( pPathID && Q_stricmp( m_pathID, pPathID ) ) )
+		return false;
+
+	return !Q_stricmp( m_videoPath, pVideoFileName );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Sets this material up to show pOwner's textures rather than decoding the
+//			file again. Anything that would take us somewhere the owner isn't going
+//			gets us our own decoder first
+//-----------------------------------------------------------------------------
+void CVideoMaterial::ShareVideo( const char *pMaterialName, CVideoMaterial *pOwner )
+{
+	Q_strncpy( m_videoPath, pOwner->m_videoPath, sizeof( m_videoPath ) );
+	Q_strncpy( m_pathID, pOwner->m_pathID, sizeof( m_pathID ) );
+	m_bHasPathID = pOwner->m_bHasPathID;
+	m_pSoundDevice = pOwner->m_pSoundDevice;
+	m_priority = pOwner->m_priority;
+
+	m_videoWidth = pOwner->m_videoWidth;
+	m_videoHeight = pOwner->m_videoHeight;
+	m_textureWidth = pOwner->m_textureWidth;
+	m_textureHeight = pOwner->m_textureHeight;
+	m_frameRate = pOwner->m_frameRate;
+
+	CreateVideoMaterial( pMaterialName, pOwner );
+	Follow( pOwner );
+}
+
+void CVideoMaterial::Follow( CVideoMaterial *pOwner )
+{
+	if ( m_pShareOwner )
+	{
+		m_pShareOwner->m_shareFollowers.FindAndRemove( this );
+		m_pShareOwner->ApplyVolume();
+	}
+
+	m_pShareOwner = pOwner;
+	m_nOwnerUpdatesSeen = pOwner->m_nUpdates;
+	pOwner->m_shareFollowers.AddToTail( this );
+	pOwner->ApplyVolume();
+	SetMaterialTextures( pOwner );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Stops following the owner, opening the file ourselves and carrying on
+//			from flTime with the owner's playback state. This opens the file and
+//			seeks on the calling thread, so it's a hitch like a synchronous load
+//-----------------------------------------------------------------------------
+bool CVideoMaterial::Unfollow( double flTime )
+{
+	CVideoMaterial *pOwner = m_pShareOwner;
+	if ( !pOwner )
+		return true;
+
+	pOwner->m_shareFollowers.FindAndRemove( this );
+	pOwner->ApplyVolume();
+	m_pShareOwner = nullptr;
+
+	m_videoStarted = pOwner->m_videoStarted;
+	m_videoPlaying = pOwner->m_videoPlaying;
+	m_videoStopped = pOwner->m_videoStopped;
+	m_videoLooping = pOwner->m_videoLooping;
+
+	// without a decoder of our own there's nothing we can show from here on
+	m_videoReady = false;
+	if ( !OpenVideo() )
+	{
+		Warning( "Couldn't reopen %s to play it separately\n", m_videoPath );
+		return false;
+	}
+	CreateSoundBuffer( m_pSoundDevice );
+	ApplyVolume();
+
+	// the owner's textures keep their names, ours just need to be different
+	static int s_nUnshared = 0;
+	char textureName[ MAX_PATH ];
+	Q_snprintf( textureName, sizeof( textureName ), "%s_unshared%d", m_videoMaterial->GetName(), s_nUnshared++ );
+	CreateVideoTextures( textureName );
+	SetMaterialTextures( this );
+
+	m_pDecodeStream = new CVideoDecodeStream( m_videoDecoder, m_priority );
+	StartFeeding();
+	m_videoReady = true;
+	return SetTime( flTime );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Called before we go somewhere our followers aren't. The first of them
+//			gets its own decoder and the rest follow it instead
+//-----------------------------------------------------------------------------
+void CVideoMaterial::ReleaseFollowers()
+{
+	while ( m_shareFollowers.Count() > 0 )
+	{
+		// removes itself either way, if it couldn't open the file try the next
+		CVideoMaterial *pNewOwner = m_shareFollowers[ 0 ];
+		if ( !pNewOwner->Unfollow( GetPassTime( m_curTime ) ) )
+			continue;
+
+		while ( m_shareFollowers.Count() > 0 )
+			m_shareFollowers[ 0 ]->Follow( pNewOwner );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Points our material at pTextureOwner's textures
+//-----------------------------------------------------------------------------
+void CVideoMaterial::SetMaterialTextures( CVideoMaterial *pTextureOwner )
+{
+	if ( !pTextureOwner->m_yTexture.IsValid() )
+		return;
+
+	bool bFound;
+	IMaterialVar *pVar = m_videoMaterial->FindVar( "$ytexture", &bFound, false );
+	if ( bFound )
+		pVar->SetTextureValue( pTextureOwner->m_yTexture );
+	pVar = m_videoMaterial->FindVar( "$cbtexture", &bFound, false );
+	if ( bFound )
+		pVar->SetTextureValue( pTextureOwner->m_cbTexture );
+	pVar = m_videoMaterial->FindVar( "$crtexture", &bFound, false );
+	if ( bFound )
+		pVar->SetTextureValue( pTextureOwner->m_crTexture );
 }
 
 const char *CVideoMaterial::GetVideoFileName()
@@ -408,17 +878,22 @@ VideoResult_t CVideoMaterial::GetLastResult()
 
 VideoFrameRate_t &CVideoMaterial::GetVideoFrameRate()
 {
+	if ( m_pShareOwner )
+		return m_pShareOwner->GetVideoFrameRate();
 	return m_frameRate;
 }
 
 // Video playback state functions
 bool CVideoMaterial::IsVideoReadyToPlay()
 {
+	CheckLoad();
 	return m_videoReady;
 }
 
 bool CVideoMaterial::IsVideoPlaying()
 {
+	if ( m_pShareOwner )
+		return m_pShareOwner->IsVideoPlaying();
 	return m_videoPlaying;
 }
 
@@ -429,6 +904,8 @@ bool CVideoMaterial::IsNewFrameReady()
 
 bool CVideoMaterial::IsFinishedPlaying()
 {
+	if ( m_pShareOwner )
+		return m_pShareOwner->IsFinishedPlaying();
 	return m_videoEnded;
 }
 
@@ -453,8 +930,9 @@ unsigned int CVideoMaterial::HandleBufferUpdates( void* params )
 		case WAIT_OBJECT_0:
 		case WAIT_OBJECT_0 + 1:
 		{
+			// whatever's in the buffer just loops if nothing is feeding it
 			unsigned int curTicks = Plat_MSTime();
-			double timepassed = ( double )( curTicks - m->m_prevTicks ) / 1000.0;
+			double timepassed = ( double )( curTicks - m->m_nFeedTicks ) / 1000.0;
 			if ( timepassed > FREEZE_TIME )
 				IDirectSoundBuffer_Stop( m->m_pAudioBuffer );
 			break;
@@ -475,15 +953,23 @@ unsigned int CVideoMaterial::HandleBufferUpdates( void* params )
 
 void CVideoMaterial::DestroySoundBuffer()
 {
+	AUTO_LOCK( m_feedMutex );
+	ReportSync();
 	if ( !m_pAudioBuffer )
 		return;
 
 #ifdef _LINUX
+	SuspendAudioRing();
+	m_soundKilled = true;
+	if ( m_nAudioUnderruns || m_nAudioOverruns )
+		DevMsg( "Video sound for %s ran out %d times and backed up %d times\n", m_videoPath, ( int )m_nAudioUnderruns, m_nAudioOverruns );
+	m_nAudioUnderruns = 0;
+	m_nAudioOverruns = 0;
+
 	if ( m_pSDLAudioStream )
 		SDL_FreeAudioStream( m_pSDLAudioStream );
 	m_pSDLAudioStream = nullptr;
 	m_pAudioBuffer = nullptr;
-	m_soundKilled = true;
 #elif _WIN32
 
 	if ( m_hBufferThreadHandle )
@@ -515,6 +1001,9 @@ void CVideoMaterial::DestroySoundBuffer()
 
 bool CVideoMaterial::StartVideo()
 {
+	if ( m_pShareOwner )
+		return m_pShareOwner->StartVideo();
+
 	if ( m_videoStarted )
 		return true;
 
@@ -522,17 +1011,20 @@ bool CVideoMaterial::StartVideo()
 	m_videoPlaying = true;
 	m_videoStopped = false;
 
-	m_currentFrame = 0;
-	m_videoTime = 0.0;
-	m_curTime = 0.0;
-
-	m_prevTicks = Plat_MSTime();
+	// position starts at zero, but carry on from wherever SetTime put us
+	m_prevTime = Plat_FloatTime();
 
 	return true;
 }
 
 bool CVideoMaterial::StopVideo()
 {
+	// reaching the end isn't going anywhere our followers aren't
+	if ( !m_videoEnded )
+		ReleaseFollowers();
+	if ( m_pShareOwner && !Unfollow( m_pShareOwner->GetPassTime( m_pShareOwner->m_curTime ) ) )
+		return false;
+
 	if ( !m_videoStarted )
 		return true;
 
@@ -545,16 +1037,32 @@ bool CVideoMaterial::StopVideo()
 
 void CVideoMaterial::SetLooping( bool bLoopVideo )
 {
+	if ( bLoopVideo != IsLooping() )
+	{
+		ReleaseFollowers();
+		if ( m_pShareOwner && !Unfollow( m_pShareOwner->GetPassTime( m_pShareOwner->m_curTime ) ) )
+			return;
+	}
+
 	m_videoLooping = bLoopVideo;
 }
 
 bool CVideoMaterial::IsLooping()
 {
+	if ( m_pShareOwner )
+		return m_pShareOwner->IsLooping();
 	return m_videoLooping;
 }
 
 void CVideoMaterial::SetPaused( bool bPauseState )
 {
+	if ( bPauseState != IsPaused() )
+	{
+		ReleaseFollowers();
+		if ( m_pShareOwner && !Unfollow( m_pShareOwner->GetPassTime( m_pShareOwner->m_curTime ) ) )
+			return;
+	}
+
 	if ( m_videoStarted )
 	{
 		// Unpause
@@ -564,7 +1072,7 @@ void CVideoMaterial::SetPaused( bool bPauseState )
 			if ( m_pAudioBuffer )
 				IDirectSoundBuffer_Play( m_pAudioBuffer, 0, 0, DSBPLAY_LOOPING );
 #endif
-			m_prevTicks = Plat_MSTime();
+			m_prevTime = Plat_FloatTime();
 		}
 #ifdef _WIN32
 		// Pause sound buffer
@@ -581,131 +1089,546 @@ void CVideoMaterial::SetPaused( bool bPauseState )
 
 bool CVideoMaterial::IsPaused()
 {
+	if ( m_pShareOwner )
+		return m_pShareOwner->IsPaused();
 	return !m_videoPlaying;
 }
 
 float CVideoMaterial::GetVideoDuration()
 {
-	if ( m_demuxer )
+	if ( m_pShareOwner )
+		return m_pShareOwner->GetVideoDuration();
+	if ( m_demuxer && !IsLoading() )
 		return m_demuxer->getLength();
 	return 0.0f;
 }
 
 int CVideoMaterial::GetFrameCount()
 {
-	return 0;
+	if ( m_pShareOwner )
+		return m_pShareOwner->GetFrameCount();
+	if ( IsLoading() )
+		return 0;
+	return m_frameIndex.GetFrameCount();
 }
 
 bool CVideoMaterial::SetFrame( int FrameNum )
 {
-	return false;
+	const float fps = GetVideoFrameRate().GetFPS();
+	if ( FrameNum < 0 || fps <= 0.0f )
+		return false;
+
+	return SetTime( FrameNum / fps );
 }
 
 int	CVideoMaterial::GetCurrentFrame()
 {
+	if ( m_pShareOwner )
+		return m_pShareOwner->GetCurrentFrame();
 	return m_currentFrame;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Seeks to the keyframe before flTime using the cues then decodes forward to it,
+//			only the frame we land on gets uploaded. Sound is buffered up to AUDIO_AHEAD_TIME
+//			past the target, the feed thread reads on from there
+//-----------------------------------------------------------------------------
 bool CVideoMaterial::SetTime( float flTime )
 {
-	return false;
-}
-
-float CVideoMaterial::GetCurrentVideoTime()
-{
-	return 0.0f;
-}
-
-bool CVideoMaterial::NeedNewFrame( double curtime )
-{
-	if ( m_videoFrames.Count() == 0 )
-		return true;
-
-	if ( m_videoFrames.Tail()->time <= curtime )
-		return true;
-
-	if( m_pAudioBuffer && m_nAudioBufferFilledSize < BUFFER_FILLED_MIN )
-		return true;
-
-	return false;
-}
-
-void CVideoMaterial::RestartVideo()
-{
-	m_currentFrame = 0;
-	m_demuxer->resetVideo();
-	m_curTime = m_videoTime = 0.0;
-	m_prevTicks = Plat_MSTime();
-#ifdef _WIN32
-	if ( m_pAudioBuffer && !m_soundKilled )
-		m_pAudioBuffer->SetCurrentPosition( 0 );
-#endif
-}
+	ReleaseFollowers();
+	if ( m_pShareOwner )
+		return Unfollow( flTime );
 
-bool CVideoMaterial::Update()
-{
-	if ( !StartVideo() )
+	if ( !m_demuxer || !m_videoReady )
 		return false;
 
-	// the video has stopped, there is nothing more to do
-	if ( m_videoStopped )
+	// everything the feed thread reads and buffers is about to be thrown away and redone
+	AUTO_LOCK( m_feedMutex );
+
+	const double target = clamp( ( double )flTime, 0.0, ( double )m_demuxer->getLength() );
+	if ( !m_demuxer->seek( target ) )
 		return false;
 
-	// we're not stopped, but we're paused
-	if ( !m_videoPlaying )
-		return true;
+	FlushVideoFrames();
+	FlushAudio();
 
-	// Update time
-	unsigned int curTicks = Plat_MSTime();
-	double timepassed = ( double )( curTicks - m_prevTicks ) / 1000.0;
-	m_curTime += timepassed;
-	m_prevTicks = curTicks;
+	// packets are muxed in time order, so once the sound is this far past the target every
+	// video frame up to it has been read. Without this a target past the last video frame, or
+	// a file with no video at all, would decode the rest of the file's sound into the buffer
+	const double audioStop = target + AUDIO_AHEAD_TIME;
+	const bool bHasVideo = m_demuxer->getVideoCodec() != WebMDemuxer::NO_VIDEO;
 
-#ifdef _WIN32
-	if ( m_pAudioBuffer )
+	bool bHaveImage = false;
+	double shownTime = 0.0;
+	WebMFrame *video_frame = bHasVideo ? new WebMFrame() : nullptr;
+	while ( m_demuxer->readFrame( video_frame, m_audioFrame ) )
 	{
-		// kinda rough but it'll do
-		m_nAudioBufferFilledSize -= m_demuxer->getSampleRate() * m_nBytesPerSample * timepassed;
-		if ( m_nAudioBufferFilledSize < 0 )
-			m_nAudioBufferFilledSize = 0;
-	}
-#endif
+		// prime the audio decoder from the keyframe on, but only keep what's past the target
+		if ( m_audioFrame->isValid() )
+		{
+			if ( m_pAudioBuffer )
+			{
+				bool bWrapped;
+				BufferAudioFrame( *m_audioFrame, target, bWrapped );
+			}
+			if ( m_audioFrame->time >= audioStop )
+				break;
+		}
 
-	if ( m_curTime < m_videoTime )
-	{
-		if( m_pAudioBuffer )
+		if ( !video_frame || !video_frame->isValid() )
+			continue;
+
+		// first frame past the target, the worker picks up from here
+		if ( video_frame->time > target + SEEK_TOLERANCE )
 		{
-			if( m_nAudioBufferFilledSize > BUFFER_FILLED_MIN )
-				return true;
+			m_pDecodeStream->QueuePacket( video_frame );
+			video_frame = nullptr;
+			break;
+		}
+
+		if ( m_videoDecoder->decode( *video_frame ) && m_videoDecoder->getImage( *m_image ) == VPXDecoder::NO_IMAGE_ERROR )
+		{
+			bHaveImage = true;
+			shownTime = m_image->time;
 		}
-		else
-			return true;
 	}
+	delete video_frame;
 
-	// Has the stream ended?
-	if ( m_demuxer->isEOS() )
+	// frame threading leaves the last few frames before the target in flight
+	if ( bHasVideo && m_videoDecoder->getFramesDelay() > 0 && m_videoDecoder->flush() )
 	{
-		// Noodles; this might be stupid
-		if ( m_videoFrames.Count() == 0 )
+		VPXDecoder::Image image;
+		VPXDecoder::IMAGE_ERROR err;
+		while ( ( err = m_videoDecoder->getImage( image ) ) != VPXDecoder::NO_FRAME )
 		{
-			if ( m_videoLooping )
-			{
-				RestartVideo();
-			}
-			else
-			{
-				m_videoEnded = true;
-				StopVideo();
-				return false;
-			}
+			if ( err != VPXDecoder::NO_IMAGE_ERROR )
+				continue;
+			*m_image = image;
+			bHaveImage = true;
+			shownTime = m_image->time;
 		}
 	}
 
-	// if we have audio check if we should update the buffer and make sure we're playing
-	bool bNeedUpdate = false;
+	if ( bHaveImage )
+		UploadImage( m_image );
+
+	m_videoTime = bHaveImage ? shownTime : target;
+	m_curTime = m_feedClock = target;
+	m_passOffset = m_shownPassStart = 0.0;
+	m_passVideoEnd = m_passAudioStart = m_passAudioEnd = -1.0;
+	m_currentFrame = ( unsigned int )( m_videoTime * m_frameRate.GetFPS() + 0.5 );
+	m_prevTime = Plat_FloatTime();
+	m_videoEnded = false;
+	m_bReadEnded = false;
+
+#ifdef _WIN32
+	// play from the start of what we just buffered
+	if ( m_pAudioBuffer && !m_soundKilled )
+	{
+		IDirectSoundBuffer_SetCurrentPosition( m_pAudioBuffer, 0 );
+		if ( m_videoStarted && m_videoPlaying )
+			IDirectSoundBuffer_Play( m_pAudioBuffer, 0, 0, DSBPLAY_LOOPING );
+	}
+#endif
+	return true;
+}
+
+float CVideoMaterial::GetCurrentVideoTime()
+{
+	if ( m_pShareOwner )
+		return m_pShareOwner->GetCurrentVideoTime();
+	return GetPassTime( m_videoTime );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Where a time from a later pass of a looping video is within the file
+//-----------------------------------------------------------------------------
+double CVideoMaterial::GetPassTime( double time ) const
+{
+	if ( m_loopPeriod <= 0.0 || time < m_loopPeriod )
+		return time;
+	return fmod( time, m_loopPeriod );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Throws away every frame we haven't shown yet, after this the decoder
+//			is ours until the next packet goes to the decode thread
+//-----------------------------------------------------------------------------
+void CVideoMaterial::FlushVideoFrames()
+{
+	if ( m_pDecodeStream )
+		m_pDecodeStream->Flush();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Resets the audio decoder and empties whatever is waiting to be played
+//-----------------------------------------------------------------------------
+void CVideoMaterial::FlushAudio()
+{
+	PurgeAudioPackets();
+	m_audioEndTime = -1.0;
+	m_bAudioPassStart = false;
+	if ( m_audioDecoder )
+		m_audioDecoder->reset();
+
+#ifdef _LINUX
+	if ( m_pSDLAudioStream )
+		SDL_AudioStreamClear( m_pSDLAudioStream );
+	// the callback skips what's left in the ring the next time it reads
+	m_audioRing.Discard();
+	m_bAudioRingFull = false;
+#elif _WIN32
+	if ( m_pAudioBuffer && !m_soundKilled )
+		IDirectSoundBuffer_Stop( m_pAudioBuffer );
+	m_nAudioBufferWriteOffset = 0;
+#endif
+	m_nAudioBufferFilledSize = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Decodes audioFrame into the sound buffer, dropping any samples before skipUntil.
+//			Returns false if nothing was buffered. bWrapped is set when the DirectSound buffer wrapped
+//-----------------------------------------------------------------------------
+bool CVideoMaterial::BufferAudioFrame( WebMFrame &audioFrame, double skipUntil, bool &bWrapped )
+{
+	bWrapped = false;
+
+	int numOutSamples = 0;
+	if ( m_bFloatPCM )
+		m_audioDecoder->getPCMF32( audioFrame, ( float* )m_pcm, numOutSamples );
+	else
+		m_audioDecoder->getPCMS16( audioFrame, ( short* )m_pcm, numOutSamples );
+	if ( numOutSamples == 0 )
+		return false;
+
+	const int nFrameSize = m_demuxer->getChannels() * ( m_bFloatPCM ? sizeof( float ) : sizeof( short ) );
+	unsigned char *pcm = m_pcm;
+	int skip = 0;
+	if ( audioFrame.time < skipUntil )
+	{
+		skip = ( int )( ( skipUntil - audioFrame.time ) * m_demuxer->getSampleRate() + 0.5 );
+		if ( skip >= numOutSamples )
+			return false;
+		pcm += skip * nFrameSize;
+		numOutSamples -= skip;
+	}
+
+	// the clock works back from here by however much the device has still to play
+	AUTO_LOCK( m_feedStateMutex );
+	m_audioEndTime = audioFrame.time + ( double )( skip + numOutSamples ) / m_demuxer->getSampleRate();
+	WritePCM( pcm, numOutSamples, bWrapped );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Buffers flSeconds of silence after the last sound buffered
+//-----------------------------------------------------------------------------
+void CVideoMaterial::BufferSilence( double flSeconds )
+{
+	const int nFrameSize = m_demuxer->getChannels() * ( m_bFloatPCM ? sizeof( float ) : sizeof( short ) );
+	const int nChunk = m_audioDecoder->getBufferSamples();
+	int numSamples = ( int )( flSeconds * m_demuxer->getSampleRate() + 0.5 );
+
+	// zero is silence as floats and as shorts
+	Q_memset( m_pcm, 0, nChunk * nFrameSize );
+
+	AUTO_LOCK( m_feedStateMutex );
+	m_audioEndTime += ( double )numSamples / m_demuxer->getSampleRate();
+	bool bWrapped;
+	while ( numSamples > 0 )
+	{
+		const int nSamples = min( numSamples, nChunk );
+		WritePCM( m_pcm, nSamples, bWrapped );
+		numSamples -= nSamples;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Hands numSamples of decoded sound, in the decoder's format, to the device.
+//			bWrapped is set when the DirectSound buffer wrapped. Needs m_feedStateMutex held
+//-----------------------------------------------------------------------------
+void CVideoMaterial::WritePCM( const unsigned char *pcm, int numSamples, bool &bWrapped )
+{
+	bWrapped = false;
+#ifdef _WIN32
+	int nBytesRead = numSamples * m_nBytesPerSample;
+	int nPCMOverflowSize = 0;
+	int nPCMOverflowOffset = 0;
+	m_nAudioBufferFilledSize += nBytesRead;
+
+	// can't fit the whole thing at the end so it needs to be split
+	if ( ( m_nAudioBufferWriteOffset + nBytesRead ) >= m_nAudioBufferSize )
+	{
+		// save amount gone over
+		nPCMOverflowSize = ( m_nAudioBufferWriteOffset + nBytesRead ) - m_nAudioBufferSize;
+		nPCMOverflowOffset = nBytesRead - nPCMOverflowSize;
+		nBytesRead -= nPCMOverflowSize;
+		bWrapped = true;
+	}
+
+	void *pAudioPtr = NULL;
+	DWORD dwAudioBytes1;
+	IDirectSoundBuffer_Lock( m_pAudioBuffer, m_nAudioBufferWriteOffset, nBytesRead, &pAudioPtr, &dwAudioBytes1, NULL, NULL, 0 );
+
+	Q_memcpy( pAudioPtr, pcm, nBytesRead );
+	m_nAudioBufferWriteOffset += nBytesRead;
+
+	IDirectSoundBuffer_Unlock( m_pAudioBuffer, pAudioPtr, dwAudioBytes1, NULL, NULL );
+
+
+	if ( m_nAudioBufferWriteOffset == m_nAudioBufferSize )
+	{
+		m_nAudioBufferWriteOffset = 0;
+		IDirectSoundBuffer_Lock( m_pAudioBuffer, 0, nBytesRead, &pAudioPtr, &dwAudioBytes1, NULL, NULL, 0 );
+
+		Q_memcpy( pAudioPtr, pcm + nPCMOverflowOffset, nPCMOverflowSize );
+		m_nAudioBufferWriteOffset += nPCMOverflowSize;
+
+		IDirectSoundBuffer_Unlock( m_pAudioBuffer, pAudioPtr, dwAudioBytes1, NULL, NULL );
+	}
+#elif _LINUX
+	// in the decoder's format, the stream converts it to the device's
+	const int nFrameSize = m_demuxer->getChannels() * ( m_bFloatPCM ? sizeof( float ) : sizeof( short ) );
+	SDL_AudioStreamPut( m_pSDLAudioStream, pcm, numSamples * nFrameSize );
+	PumpAudioRing();
+#endif
+}
+
+#ifdef _LINUX
+//-----------------------------------------------------------------------------
+// Purpose: Moves converted sound from the stream into the ring the callback reads,
+//			as much as there's room for. The rest waits in the stream for next time
+//-----------------------------------------------------------------------------
+void CVideoMaterial::PumpAudioRing()
+{
+	// the clock reads how much is waiting in the stream and the ring
+	AUTO_LOCK( m_feedStateMutex );
+	if ( !m_pSDLAudioStream || !m_audioRing.IsValid() )
+		return;
+
+	Uint8 chunk[ 4096 ];
+	for ( ;; )
+	{
+		const int nWaiting = SDL_AudioStreamAvailable( m_pSDLAudioStream );
+		const int nSpace = m_audioRing.GetWriteSpace();
+		int nBytes = min( nWaiting, min( nSpace, ( int )sizeof( chunk ) ) );
+		// the stream only hands out whole sample frames
+		nBytes -= nBytes % m_nBytesPerSample;
+		if ( nBytes <= 0 )
+			break;
+
+		nBytes = SDL_AudioStreamGet( m_pSDLAudioStream, chunk, nBytes );
+		if ( nBytes <= 0 )
+			break;
+		m_audioRing.Write( chunk, nBytes );
+	}
+
+	const int nWaiting = SDL_AudioStreamAvailable( m_pSDLAudioStream );
+	const bool bFull = nWaiting >= m_nBytesPerSample;
+	if ( bFull && !m_bAudioRingFull )
+		++m_nAudioOverruns;
+	m_bAudioRingFull = bFull;
+
+	m_nAudioBufferFilledSize = m_audioRing.GetQueued() + nWaiting;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Keeps the mixer callback off the ring and waits out one that's already
+//			reading, so the ring and the buffer it reads into can be set up or freed
+//-----------------------------------------------------------------------------
+void CVideoMaterial::SuspendAudioRing()
+{
+	m_nAudioRingReady = 0;
+	// a period's worth of mixing at most
+	while ( m_nAudioReaders > 0 )
+		ThreadSleep( 0 );
+}
+#endif
+
+void CVideoMaterial::PurgeAudioPackets()
+{
+	while ( m_audioPackets.Count() > 0 )
+		delete m_audioPackets.RemoveAtHead();
+}
+
+bool CVideoMaterial::NeedNewFrame( double curtime )
+{
+	// without any video, reading is only for the sound's sake
+	if ( m_demuxer->getVideoCodec() == WebMDemuxer::NO_VIDEO )
+		return false;
+
+	// keep the decode thread fed
+	if ( m_pDecodeStream->NeedsPackets() )
+		return true;
+
+	if ( m_pDecodeStream->GetLastQueuedTime() <= curtime )
+		return true;
+
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: True while there's less than AUDIO_AHEAD_TIME of sound waiting to be played
+//-----------------------------------------------------------------------------
+bool CVideoMaterial::NeedAudio()
+{
+	if ( !m_pAudioBuffer )
+		return false;
+
+	return m_nAudioBufferFilledSize < AUDIO_AHEAD_TIME * GetAudioBytesPerSecond();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Of the sound as it's buffered for the device
+//-----------------------------------------------------------------------------
+int CVideoMaterial::GetAudioBytesPerSecond()
+{
+#ifdef _LINUX
+	return m_pAudioDevice->freq * m_nBytesPerSample;
+#else
+	return m_demuxer->getSampleRate() * m_nBytesPerSample;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Time of the sound the device is playing right now, worked back from the
+//			end of what's been buffered by however much of it is still to be played.
+//			False if the device isn't playing any of ours. Needs m_feedStateMutex held
+//-----------------------------------------------------------------------------
+bool CVideoMaterial::GetAudioClock( double &clock )
+{
+	if ( !m_pAudioBuffer || m_soundKilled || m_audioEndTime < 0.0 )
+		return false;
+
+	const double bytesPerSecond = GetAudioBytesPerSecond();
+#ifdef _LINUX
+	// the callback ran dry or hasn't been called in a while, either way the device isn't playing ours
+	const double period = ( double )m_pAudioDevice->samples / m_pAudioDevice->freq;
+	const double sinceRead = Plat_FloatTime() - m_flAudioReadTime;
+	if ( m_bAudioStarved || m_flAudioReadTime <= 0.0 || sinceRead > 2.0 * period )
+		return false;
+
+	// what the callback last took is played over the period after it took it
+	const int nQueued = m_audioRing.GetQueued() + SDL_AudioStreamAvailable( m_pSDLAudioStream );
+	clock = m_audioEndTime - nQueued / bytesPerSecond - period + clamp( sinceRead, 0.0, period );
+	return true;
+#elif _WIN32
+	DWORD status = 0;
+	DWORD dwPlayCursor = 0;
+	if ( FAILED( m_pAudioBuffer->GetStatus( &status ) ) || !( status & DSBSTATUS_PLAYING ) ||
+		 FAILED( IDirectSoundBuffer_GetCurrentPosition( m_pAudioBuffer, &dwPlayCursor, NULL ) ) )
+		return false;
+
+	// the play cursor is past what we wrote if we've run dry, which looks like nearly a whole buffer
+	const int nQueued = ( m_nAudioBufferWriteOffset - ( int )dwPlayCursor + m_nAudioBufferSize ) % m_nAudioBufferSize;
+	if ( nQueued > 2.0 * AUDIO_AHEAD_TIME * bytesPerSecond )
+		return false;
+
+	clock = m_audioEndTime - nQueued / bytesPerSecond;
+	return true;
+#else
+	return false;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: How well the pictures kept up with the sound, when the sound stops
+//-----------------------------------------------------------------------------
+void CVideoMaterial::ReportSync()
+{
+	if ( m_nAVOffsets > 0 )
+	{
+		DevMsg( "Video %s was %.1fms ahead of its sound on average, %.1fms at worst\n", m_videoPath,
+			1000.0 * m_avOffsetTotal / m_nAVOffsets, 1000.0 * m_avOffsetWorst );
+	}
+	m_avOffsetTotal = 0.0;
+	m_avOffsetWorst = 0.0;
+	m_nAVOffsets = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Reads the next packet. Video goes to the decode stream and sound to the
+//			queue the feed thread decodes from. False once there's nothing left to read
+//-----------------------------------------------------------------------------
+bool CVideoMaterial::ReadPacket()
+{
+	WebMFrame *video_frame = new WebMFrame();
+	if ( !m_demuxer->readFrame( video_frame, m_audioFrame ) )
+	{
+		delete video_frame;
+
+		// carry straight on from the start, so its frames are decoded and its sound
+		// buffered by the time the last frames have been shown
+		if ( m_videoLooping && LoopToStart() )
+			return true;
+
+		// let the decoder give up what it's still holding
+		m_pDecodeStream->QueueEndOfStream();
+		AUTO_LOCK( m_feedStateMutex );
+		m_bReadEnded = true;
+		return false;
+	}
+
+	if ( video_frame->isValid() )
+	{
+		m_passVideoEnd = max( m_passVideoEnd, video_frame->time );
+		video_frame->time += m_passOffset;
+		m_pDecodeStream->QueuePacket( video_frame );
+	}
+	else
+	{
+		delete video_frame;
+	}
+
+	if ( m_audioFrame->isValid() && m_audioFrame->time > m_passAudioStart )
+	{
+		// the last packet is taken to be as long as the one before it
+		const double length = m_passAudioStart >= 0.0 ? m_audioFrame->time - m_passAudioStart : 0.0;
+		m_passAudioStart = m_audioFrame->time;
+		m_passAudioEnd = m_passAudioStart + length;
+	}
+
+	if ( m_audioFrame->isValid() && m_pAudioBuffer )
+	{
+		m_audioFrame->time += m_passOffset;
+		m_audioPackets.Insert( m_audioFrame );
+		m_audioFrame = new WebMFrame();
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: One look from the feed thread, with m_feedMutex held. Decodes queued sound
+//			until there's AUDIO_AHEAD_TIME of it buffered, reading more of the file
+//			whenever either that or the decode stream runs short
+//-----------------------------------------------------------------------------
+void CVideoMaterial::Feed()
+{
+	const unsigned int curTicks = Plat_MSTime();
+	const unsigned int prevTicks = m_nFeedTicks;
+	m_nFeedTicks = curTicks;
+
+	if ( !m_videoReady || !m_videoStarted || m_videoStopped || !m_videoPlaying )
+		return;
+
+	double feedClock;
+	{
+		AUTO_LOCK( m_feedStateMutex );
+		feedClock = m_feedClock;
+	}
+
+	// if we have audio check how much has played since last time and make sure we're playing
 #ifdef _WIN32
+	if ( m_pAudioBuffer )
+	{
+		// kinda rough but it'll do
+		m_nAudioBufferFilledSize -= m_demuxer->getSampleRate() * m_nBytesPerSample * ( ( double )( curTicks - prevTicks ) / 1000.0 );
+		if ( m_nAudioBufferFilledSize < 0 )
+			m_nAudioBufferFilledSize = 0;
+	}
+
 	DWORD status = NULL;
-	if ( !m_demuxer->isEOS() && m_pAudioBuffer )
+	if ( !m_bReadEnded && m_pAudioBuffer )
 	{
 		m_pAudioBuffer->GetStatus( &status );
 		if ( !( status & DSBSTATUS_PLAYING ) )
@@ -714,124 +1637,312 @@ bool CVideoMaterial::Update()
 			IDirectSoundBuffer_Play( m_pAudioBuffer, 0, 0, DSBPLAY_LOOPING );
 		}
 	}
+#elif _LINUX
+	// the callback has made room since last time, move along whatever didn't fit
+	PumpAudioRing();
 #endif
-	// Read until we've filled the buffer or got enough frames
-	while ( NeedNewFrame( m_curTime ) || bNeedUpdate )
-	{
-		WebMFrame* video_frame = new WebMFrame();
-		// did we reach the EOS
-		if ( !m_demuxer->readFrame( video_frame, m_audioFrame ) )
-		{
-			bNeedUpdate = false;
-			delete video_frame;
-			break;
-		}
-		else if ( !video_frame->isValid() )
-		{
-			delete video_frame;
-		}
-		else
-		{
-			m_videoFrames.Insert( video_frame );
-		}
 
-		bNeedUpdate = false;
-		if ( m_audioFrame->isValid() && m_pAudioBuffer )
+	for ( ;; )
+	{
+		while ( m_audioPackets.Count() > 0 && NeedAudio() )
 		{
-			int numOutSamples = 0;
-			
-			m_audioDecoder->getPCMS16( *m_audioFrame, m_pcm, numOutSamples );
-			if ( numOutSamples == 0 )
+			WebMFrame *pFrame = m_audioPackets.RemoveAtHead();
+			if ( !pFrame )
+			{
+				// the next pass of a loop, it carries on from the end of the last so the decoder
+				// has to start clean and without the codec's priming
+				m_audioDecoder->restart();
+				m_bAudioPassStart = true;
 				continue;
+			}
 
-			int nBytesRead = numOutSamples * m_nBytesPerSample;
-#ifdef _WIN32
-			int nPCMOverflowSize = 0;
-			int nPCMOverflowOffset = 0;
-			m_nAudioBufferFilledSize += nBytesRead;
-
-			// can't fit the whole thing at the end so it needs to be split
-			if ( ( m_nAudioBufferWriteOffset + nBytesRead ) >= m_nAudioBufferSize )
+			// the device plays each pass straight on from the last, whatever its sound is stamped with.
+			// Fill a gap with silence and trim an overlap so the sound keeps time with the frames over the seam
+			double skipUntil = 0.0;
+			if ( m_bAudioPassStart && m_audioEndTime >= 0.0 )
 			{
-				// save amount gone over
-				nPCMOverflowSize = ( m_nAudioBufferWriteOffset + nBytesRead ) - m_nAudioBufferSize;
-				nPCMOverflowOffset = nBytesRead - nPCMOverflowSize;
-				nBytesRead -= nPCMOverflowSize;
-				bNeedUpdate = true;
+				if ( pFrame->time > m_audioEndTime )
+					BufferSilence( pFrame->time - m_audioEndTime );
+				else
+					skipUntil = m_audioEndTime;
 			}
+			m_bAudioPassStart = false;
+
+			bool bWrapped;
+			BufferAudioFrame( *pFrame, skipUntil, bWrapped );
+			delete pFrame;
+		}
+
+		if ( m_bReadEnded || !( NeedNewFrame( feedClock ) || ( m_audioPackets.Count() == 0 && NeedAudio() ) ) )
+			break;
+
+		if ( !ReadPacket() )
+			break;
+	}
+}
 
-			void *pAudioPtr = NULL;
-			DWORD dwAudioBytes1;
-			IDirectSoundBuffer_Lock( m_pAudioBuffer, m_nAudioBufferWriteOffset, nBytesRead, &pAudioPtr, &dwAudioBytes1, NULL, NULL, 0 );
+void CVideoMaterial::RunFeed()
+{
+	while ( !m_bFeedExit )
+	{
+		m_feedEvent.Wait( FEED_INTERVAL );
+		if ( m_bFeedExit )
+			break;
 
-			Q_memcpy( pAudioPtr, m_pcm, nBytesRead );
-			m_nAudioBufferWriteOffset += nBytesRead;
+		// updates don't wait on this, only seeks, restarts and the sound going away do
+		AUTO_LOCK( m_feedMutex );
+		Feed();
+	}
+}
 
-			IDirectSoundBuffer_Unlock( m_pAudioBuffer, pAudioPtr, dwAudioBytes1, NULL, NULL );
+unsigned int CVideoMaterial::FeedThreadFunc( void *params )
+{
+	( ( CVideoMaterial * )params )->RunFeed();
+	return 0;
+}
 
+void CVideoMaterial::StartFeeding()
+{
+	m_bFeedExit = false;
+	m_nFeedTicks = Plat_MSTime();
+	m_hFeedThread = CreateSimpleThread( FeedThreadFunc, this );
+}
 
-			if ( m_nAudioBufferWriteOffset == m_nAudioBufferSize )
-			{
-				m_nAudioBufferWriteOffset = 0;
-				IDirectSoundBuffer_Lock( m_pAudioBuffer, 0, nBytesRead, &pAudioPtr, &dwAudioBytes1, NULL, NULL, 0 );
+void CVideoMaterial::StopFeeding()
+{
+	if ( !m_hFeedThread )
+		return;
 
-				Q_memcpy( pAudioPtr, ( char* )( m_pcm )+nPCMOverflowOffset, nPCMOverflowSize );
-				m_nAudioBufferWriteOffset += nPCMOverflowSize;
+	m_bFeedExit = true;
+	m_feedEvent.Set();
+	ThreadJoin( m_hFeedThread );
+	ReleaseThreadHandle( m_hFeedThread );
+	m_hFeedThread = nullptr;
+}
 
-				IDirectSoundBuffer_Unlock( m_pAudioBuffer, pAudioPtr, dwAudioBytes1, NULL, NULL );
-			}
-#elif _LINUX
-			SDL_AudioStreamPut(m_pSDLAudioStream, m_pcm, nBytesRead);
+void CVideoMaterial::RestartVideo()
+{
+	m_currentFrame = 0;
+	m_demuxer->resetVideo();
+	m_bReadEnded = false;
+	// whatever's left of the end would throw the clock, and there's next to none of it by now anyway
+	FlushAudio();
+	if ( m_audioDecoder )
+		m_audioDecoder->restart();
+	m_curTime = m_videoTime = 0.0;
+	m_passOffset = m_shownPassStart = 0.0;
+	m_passVideoEnd = m_passAudioStart = m_passAudioEnd = -1.0;
+	m_feedClock = 0.0;
+	m_prevTime = Plat_FloatTime();
+#ifdef _WIN32
+	if ( m_pAudioBuffer && !m_soundKilled )
+		m_pAudioBuffer->SetCurrentPosition( 0 );
 #endif
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Starts reading the next pass of a looping video, false if the pass
+//			that just ended had nothing in it
+//-----------------------------------------------------------------------------
+bool CVideoMaterial::LoopToStart()
+{
+	// same file every time so the length of a pass is only worked out once. The file should say, otherwise
+	// it runs until the later of the sound ending and the frame after the last one being due. The framerate
+	// may only be a guess, but it's only a frame's worth of what the video's length comes from
+	if ( m_loopPeriod <= 0.0 )
+	{
+		const float fps = m_frameRate.GetFPS();
+		double period = m_passAudioEnd;
+		if ( m_passVideoEnd >= 0.0 )
+			period = max( period, m_passVideoEnd + ( fps > 0.0f ? 1.0 / fps : 0.0 ) );
+
+		const double length = m_demuxer->getLength();
+		if ( length > m_passVideoEnd && length > m_passAudioStart )
+			period = length;
+
+		if ( period <= 0.0 )
+			return false;
+
+		AUTO_LOCK( m_feedStateMutex );
+		m_loopPeriod = period;
+	}
+
+	{
+		AUTO_LOCK( m_feedStateMutex );
+		m_passOffset += m_loopPeriod;
+	}
+	m_passVideoEnd = m_passAudioStart = m_passAudioEnd = -1.0;
+	m_demuxer->resetVideo();
+
+	// the sound carries on from the end of the last pass, so it has to start clean and without the codec's
+	// priming. What's still queued from the last pass is decoded first, so mark where in the queue that is
+	if ( m_pAudioBuffer )
+		m_audioPackets.Insert( nullptr );
+	else if ( m_audioDecoder )
+		m_audioDecoder->restart();
+	return true;
+}
 
-			// if our timer is waayyy ahead set it back to the audio time
-			if ( m_curTime > m_audioFrame->time )
+//-----------------------------------------------------------------------------
+// Purpose: Picks up the index once the background build finishes
+//-----------------------------------------------------------------------------
+void CVideoMaterial::CheckFrameIndex()
+{
+	if ( !m_pIndexBuilder || !m_pIndexBuilder->IsDone() )
+		return;
+
+	// the feed thread could be reading through the demuxer
+	AUTO_LOCK( m_feedMutex );
+
+	m_frameIndex.Swap( m_pIndexBuilder->GetIndex() );
+	delete m_pIndexBuilder;
+	m_pIndexBuilder = nullptr;
+
+	if ( m_frameIndex.IsValid() )
+	{
+		m_demuxer->setIndex( &m_frameIndex );
+		if ( m_frameIndex.GetFrameRate() > 0.0 )
+			m_frameRate.SetFPS( m_frameIndex.GetFrameRate() );
+	}
+}
+
+bool CVideoMaterial::Update()
+{
+	// the owner's textures are ours too, so keeping it going is all there is to do. The game
+	// or another follower may have updated it already this frame, it should only move on once a frame
+	if ( m_pShareOwner )
+	{
+		if ( m_pShareOwner->m_nUpdates == m_nOwnerUpdatesSeen )
+			m_pShareOwner->Update();
+		m_nOwnerUpdatesSeen = m_pShareOwner->m_nUpdates;
+		return m_pShareOwner->m_bLastUpdate;
+	}
+
+	++m_nUpdates;
+	m_bLastUpdate = UpdatePlayback();
+	return m_bLastUpdate;
+}
+
+bool CVideoMaterial::UpdatePlayback()
+{
+	// still opening, or lost our owner and couldn't open the file ourselves
+	CheckLoad();
+	if ( !m_videoReady )
+		return false;
+
+	if ( !StartVideo() )
+		return false;
+
+	CheckFrameIndex();
+
+	// the video has stopped, there is nothing more to do
+	if ( m_videoStopped )
+		return false;
+
+	// we're not stopped, but we're paused
+	if ( !m_videoPlaying )
+		return true;
+
+	// Update time
+	const double curTime = Plat_FloatTime();
+	const double timepassed = curTime - m_prevTime;
+	m_curTime += timepassed;
+	m_prevTime = curTime;
+
+	double audioClock = 0.0;
+	bool bAudioClock;
+	bool bEnded = false;
+	bool bReadEnded;
+	{
+		// the feed thread moves the pass along and says when reading has ended. Only what it shares
+		// with us is locked, it reads and decodes without holding us up
+		AUTO_LOCK( m_feedStateMutex );
+
+		// while the device is playing our sound it's the clock that matters. Small drift is
+		// made up by running a little fast or slow so nothing jumps, anything big is snapped to
+		bAudioClock = GetAudioClock( audioClock );
+		if ( bAudioClock )
+		{
+			const double drift = audioClock - m_curTime;
+			if ( fabs( drift ) > AV_SYNC_SNAP )
+				m_curTime = audioClock;
+			else
+				m_curTime += clamp( drift, -AV_SYNC_SLEW * timepassed, AV_SYNC_SLEW * timepassed );
+		}
+
+		// into a pass that was read ahead while we were looping
+		while ( m_loopPeriod > 0.0 && m_shownPassStart < m_passOffset && m_curTime >= m_shownPassStart + m_loopPeriod )
+		{
+			// looping was turned off after the start had already been read, so this is the end
+			if ( !m_videoLooping )
 			{
-				m_curTime = m_audioFrame->time;
+				bEnded = true;
+				break;
 			}
+			m_shownPassStart += m_loopPeriod;
+		}
+
+		bReadEnded = m_bReadEnded;
+		m_feedClock = m_curTime;
+	}
+
+	// Has the stream ended?
+	if ( !bEnded && bReadEnded && !m_pDecodeStream->HasPendingFrames() )
+	{
+		if ( m_videoLooping )
+		{
+			// the feed thread has stopped reading, but the demuxer and the sound are still its
+			AUTO_LOCK( m_feedMutex );
+			RestartVideo();
+			bReadEnded = false;
 		}
+		else
+		{
+			bEnded = true;
+		}
+	}
+
+	if ( bEnded )
+	{
+		m_videoEnded = true;
+		StopVideo();
+		return false;
 	}
 
+	// reading and the sound are seen to on the feed thread, let it know where we've got to
+	m_feedEvent.Set();
+
 	// roll back for videos with no audio
-	if ( !m_demuxer->isEOS() && !m_audioDecoder->isOpen() )
+	if ( !bReadEnded && !m_audioDecoder->isOpen() )
 	{
 		// if our current time is out, roll it back
 		// Noodles; I feel this will cause issues, but it seems fine right now
 		double frameDur = 1.0 / m_frameRate.GetFPS();
-		if ( m_videoFrames.Count() > 0 && ( m_curTime - m_videoFrames.Head()->time ) > ( frameDur * 6.0 ) )
+		double nextFrameTime;
+		if ( m_pDecodeStream->GetNextFrameTime( nextFrameTime ) && ( m_curTime - nextFrameTime ) > ( frameDur * 6.0 ) )
 		{
 			m_curTime = m_videoTime - frameDur;
 		}
 	}
 
-	while ( m_videoFrames.Count() > 0 && m_curTime >= m_videoTime )
+	// decoding happened on the worker, just show whatever's due. If we're behind only the newest
+	// due frame is uploaded, and the worker drops anything it finds is already late
+	m_pDecodeStream->SetClock( m_curTime );
+	int nSkipped;
+	if ( const DecodedFrame_t *pFrame = m_pDecodeStream->GetDueFrame( m_curTime, nSkipped ) )
 	{
-		if ( m_videoFrames.Head()->isValid() )
-		{
-			// TODO figure out how to skip frames
-			m_videoDecoder->decode( *m_videoFrames.Head() );
+		UploadImage( &pFrame->image );
+		m_videoTime = pFrame->time;
+		m_currentFrame = ( unsigned int )( GetPassTime( m_videoTime ) * m_frameRate.GetFPS() + 0.5 );
 
-			VPXDecoder::IMAGE_ERROR err;
-			if ( ( err = m_videoDecoder->getImage( *m_image ) ) != VPXDecoder::NO_FRAME )
-			{
-				if ( err == VPXDecoder::IMAGE_ERROR::NO_IMAGE_ERROR )
-				{
-					m_yTextureRegen->m_decodedImage = m_image;
-					m_crTextureRegen->m_decodedImage = m_image;
-					m_cbTextureRegen->m_decodedImage = m_image;
-
-					m_yTexture->Download();
-					m_crTexture->Download();
-					m_cbTexture->Download();
-				}
-			}
-			m_videoTime = m_videoFrames.Head()->time;
-			m_currentFrame++;
+		if ( bAudioClock )
+		{
+			const double offset = m_videoTime - audioClock;
+			m_avOffsetTotal += offset;
+			if ( fabs( offset ) > fabs( m_avOffsetWorst ) )
+				m_avOffsetWorst = offset;
+			++m_nAVOffsets;
 		}
-
-		WebMFrame *frame = m_videoFrames.RemoveAtHead();
-		if( frame )
-			delete frame;
 	}
 	
 	return true;
@@ -840,18 +1951,30 @@ bool CVideoMaterial::Update()
 // Material / Texture Info functions
 IMaterial *CVideoMaterial::GetMaterial()
 {
+	CheckLoad();
 	return m_videoMaterial;
 }
 
 // Where the video is actually is within the texture
 void CVideoMaterial::GetVideoTexCoordRange( float *pMaxU, float *pMaxV )
 {
+	// no textures until it's loaded, or at all without a video track
+	if ( !m_videoReady || !m_textureWidth || !m_textureHeight )
+	{
+		*pMaxU = *pMaxV = 0.0f;
+		return;
+	}
 	*pMaxU = (float)m_videoWidth / (float)m_textureWidth;
 	*pMaxV = (float)m_videoHeight / (float)m_textureHeight;
 }
 
 void CVideoMaterial::GetVideoImageSize( int *pWidth, int *pHeight )
 {
+	if ( IsLoading() )
+	{
+		*pWidth = *pHeight = 0;
+		return;
+	}
 	*pWidth = m_videoWidth;
 	*pHeight = m_videoHeight;
 }
@@ -859,18 +1982,38 @@ void CVideoMaterial::GetVideoImageSize( int *pWidth, int *pHeight )
 // Audio Functions
 bool CVideoMaterial::HasAudio()
 {
+	if ( m_pShareOwner )
+		return m_pShareOwner->HasAudio();
+	if ( IsLoading() )
+		return false;
 	return m_audioDecoder && m_audioDecoder->isOpen();
 }
 
 bool CVideoMaterial::SetVolume( float fVolume )
 {
 	m_volume = min( 1.0f, max( 0.0f, fVolume ) );
+
+	// followers are only ever heard through the owner
+	if ( m_pShareOwner )
+		return m_pShareOwner->ApplyVolume();
+	return ApplyVolume();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Sets the sound buffer to the loudest of our volume and our followers'
+//-----------------------------------------------------------------------------
+bool CVideoMaterial::ApplyVolume()
+{
+	float flVolume = m_volume;
+	FOR_EACH_VEC( m_shareFollowers, i )
+		flVolume = max( flVolume, m_shareFollowers[ i ]->m_volume );
+
 	if ( !m_pAudioBuffer )
 		return false;
 
 #ifdef _WIN32
 	// TODO figure out what fucking value I'm supposed to use
-	float log_volume = pow( m_volume, 0.2 );
+	float log_volume = pow( flVolume, 0.2 );
 	IDirectSoundBuffer_SetVolume( m_pAudioBuffer, ( LONG )( -10000 * ( 1.0f - log_volume ) ) );
 	return true;
 #elif _LINUX
@@ -896,6 +2039,20 @@ bool CVideoMaterial::IsMuted()
 
 VideoResult_t CVideoMaterial::SoundDeviceCommand( VideoSoundDeviceOperation_t operation, void *pDevice, void *pData )
 {
+	// nothing to play, just remember the device for if we ever get our own decoder
+	// or for when we've finished loading
+	if ( m_pShareOwner || IsLoading() )
+	{
+#ifdef _WIN32
+		if ( operation == VideoSoundDeviceOperation_t::SET_DIRECT_SOUND_DEVICE )
+			m_pSoundDevice = pDevice;
+#elif _LINUX
+		if ( operation == VideoSoundDeviceOperation_t::SET_SDL_PARAMS )
+			m_pSoundDevice = pDevice;
+#endif
+		return VideoResult_t::SUCCESS;
+	}
+
 #ifdef _WIN32
 	if ( operation == VideoSoundDeviceOperation_t::SET_DIRECT_SOUND_DEVICE )
 	{
@@ -922,24 +2079,36 @@ VideoResult_t CVideoMaterial::SoundDeviceCommand( VideoSoundDeviceOperation_t op
 	}
 	else if( operation == VideoSoundDeviceOperation_t::SDLMIXER_CALLBACK )
 	{
-		if ( !m_audioDecoder->isOpen() )
+		if ( !m_audioDecoder || !m_audioDecoder->isOpen() )
 			return VideoResult_t::SUCCESS;
 
 		if( !m_videoPlaying )
 			return VideoResult_t::SUCCESS;
 
-		if( m_soundKilled)
-			return VideoResult_t::SUCCESS;
-
-		int length = *(int *)pData;
-		if( SDL_AudioStreamAvailable(m_pSDLAudioStream) < length)
+		// counted before looking, so once the game thread has cleared the flag and seen no
+		// readers, nothing can be reading until it's set again
+		++m_nAudioReaders;
+		if ( !m_nAudioRingReady )
+		{
+			--m_nAudioReaders;
 			return VideoResult_t::SUCCESS;
-		
-		SDL_AudioStreamGet( m_pSDLAudioStream, m_pAudioBuffer, length);
-		SDL_MixAudioFormat( (Uint8 *)pDevice, m_pAudioBuffer, m_pAudioDevice->format, length, (int)(GetVolume() * SDL_MIX_MAXVOLUME) );
-
-		m_nAudioBufferFilledSize = SDL_AudioStreamAvailable(m_pSDLAudioStream);
+		}
 
+		// the stream belongs to the game thread, all we touch here is the ring. Whatever
+		// there is gets played, and the rest of the period is left to the other sounds
+		const int length = min( *(int *)pData, ( int )m_pAudioDevice->size );
+		const int nBytes = m_audioRing.Read( m_pAudioBuffer, length );
+		m_flAudioReadTime = Plat_FloatTime();
+		if ( nBytes > 0 )
+			SDL_MixAudioFormat( (Uint8 *)pDevice, m_pAudioBuffer, m_pAudioDevice->format, nBytes, (int)(GetVolume() * SDL_MIX_MAXVOLUME) );
+
+		// count running dry once, not every period it stays that way
+		const bool bStarved = nBytes < length;
+		if ( bStarved && !m_bAudioStarved )
+			++m_nAudioUnderruns;
+		m_bAudioStarved = bStarved;
+
+		--m_nAudioReaders;
 		return VideoResult_t::SUCCESS;
 	}
 #endif
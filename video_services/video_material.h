@@ -11,7 +11,10 @@
 
 #include "OpusVorbisDecoder.hpp"
 #include "VPXDecoder.hpp"
-#include <mkvparser/mkvparser.h>
+#include "video_reader.h"
+#include "video_index.h"
+#include "video_decode_thread.h"
+#include "video_audio_ring.h"
 
 #ifdef _WIN32
 #include <windows.h>
@@ -27,46 +30,6 @@ typedef enum YUVChannel_e {
 	YUVCHANNEL_CR,
 } YUVChannel_t;
 
-class MkvReader : public mkvparser::IMkvReader
-{
-public:
-	MkvReader( const char *filePath ) :
-		m_file( fopen( filePath, "rb" ) )
-	{}
-	~MkvReader()
-	{
-		if ( m_file )
-			fclose( m_file );
-	}
-
-	int Read( long long pos, long len, unsigned char *buf )
-	{
-		if ( !m_file )
-			return -1;
-		fseek( m_file, pos, SEEK_SET );
-		const size_t size = fread( buf, 1, len, m_file );
-		if ( size < size_t( len ) )
-			return -1;
-		return 0;
-	}
-	int Length( long long *total, long long *available )
-	{
-		if ( !m_file )
-			return -1;
-		const long pos = ftell( m_file );
-		fseek( m_file, 0, SEEK_END );
-		if ( total )
-			*total = ftell( m_file );
-		if ( available )
-			*available = ftell( m_file );
-		fseek( m_file, pos, SEEK_SET );
-		return 0;
-	}
-
-private:
-	FILE *m_file;
-};
-
 template <YUVChannel_t Channel>
 class CYUVTextureRegenerator : public ITextureRegenerator
 {
@@ -81,7 +44,7 @@ public:
 	// ITextureRegenerator
 	virtual void RegenerateTextureBits( ITexture *pTexture, IVTFTexture *pVTFTexture, Rect_t *pSubRect );
 	virtual void Release() {};
-	VPXDecoder::Image *m_decodedImage;
+	const VPXDecoder::Image *m_decodedImage;
 
 private:
 	int m_videoWidth;
@@ -100,7 +63,22 @@ public:
 
 	virtual VideoFrameRate_t &GetVideoFrameRate();
 
-	bool LoadVideo( const char *pMaterialName, const char *pVideoFileName, void *pSoundDevice = nullptr );
+	// With bAsync the file is opened and the first frame decoded on a thread of its own, the material
+	// isn't ready to play until that's done and the main thread has made its textures
+	bool LoadVideo( const char *pMaterialName, const char *pVideoFileName, const char *pPathID, void *pSoundDevice = nullptr,
+		VideoDecodePriority_t priority = VIDEO_DECODE_PRIORITY_WORLD, bool bAsync = false );
+
+	// Materials playing the same file from the same point show one set of decoded frames. Only
+	// the owner is heard, at the loudest volume of it and its followers. A follower sent somewhere
+	// the owner isn't opens the file there and then, on the game thread
+	bool CanShare( const char *pVideoFileName, const char *pPathID ) const;
+	void ShareVideo( const char *pMaterialName, CVideoMaterial *pOwner );
+
+	// Deletes the material. One that's still loading is left for its load thread to delete
+	// once the open is done, rather than waiting on it here
+	void Destroy();
+	// Waits until every load left behind by Destroy has finished and freed its material
+	static void WaitForAbandonedLoads();
 
 	// Audio Functions
 	virtual bool				HasAudio();
@@ -153,21 +131,65 @@ public:
 
 private:
 	bool NeedNewFrame( double timepassed );
+	bool UpdatePlayback();
+	bool ApplyVolume();
 	bool CreateSoundBuffer(void *pSoundDevice = nullptr);
 	void DestroySoundBuffer();
 	void RestartVideo();
-	void CreateVideoMaterial(const char *pMaterialName);
+	bool LoopToStart();
+	double GetPassTime( double time ) const;
+	static unsigned int LoadThreadFunc( void *params );
+	void CheckLoad();
+	bool IsLoading() const;
+	bool FinishLoad();
+	bool OpenVideo();
+	void CreateVideoTextures( const char *pTextureName );
+	void CreateVideoMaterial( const char *pMaterialName, CVideoMaterial *pTextureOwner );
+	void DecodeFirstFrame();
+	void ShowFirstFrame();
+	void Follow( CVideoMaterial *pOwner );
+	bool Unfollow( double flTime );
+	void ReleaseFollowers();
+	void SetMaterialTextures( CVideoMaterial *pTextureOwner );
+	void UploadImage( const VPXDecoder::Image *pImage );
+	bool BufferAudioFrame( WebMFrame &audioFrame, double skipUntil, bool &bWrapped );
+	void BufferSilence( double flSeconds );
+	void WritePCM( const unsigned char *pcm, int numSamples, bool &bWrapped );
+	void PurgeAudioPackets();
+	static unsigned int FeedThreadFunc( void *params );
+	void StartFeeding();
+	void StopFeeding();
+	void RunFeed();
+	void Feed();
+	bool ReadPacket();
+	bool NeedAudio();
+	int GetAudioBytesPerSecond();
+	bool GetAudioClock( double &clock );
+	void ReportSync();
+#ifdef _LINUX
+	void PumpAudioRing();
+	void SuspendAudioRing();
+#endif
+	void FlushVideoFrames();
+	void FlushAudio();
+	void CheckFrameIndex();
 
 private:
 
-	MkvReader *m_mkvReader;
+	CVideoReader *m_mkvReader;
 	WebMDemuxer *m_demuxer;
-	VPXDecoder *m_videoDecoder;
+	VPXDecoder *m_videoDecoder; // null when the file only has sound
+	int m_nDecoderThreads; // reserved from the decode pool for it
 	OpusVorbisDecoder *m_audioDecoder;
-	WebMFrame *m_audioFrame;
+	WebMFrame *m_audioFrame; // next one to read sound into
+	// sound read but not decoded yet, oldest first. A null entry is where a loop restarts the decoder
+	CUtlQueue< WebMFrame * > m_audioPackets;
 	VideoFrameRate_t m_frameRate;
 	VPXDecoder::Image *m_image;
 
+	CVideoFrameIndex m_frameIndex;
+	CVideoIndexBuilder *m_pIndexBuilder;
+
 	CMaterialReference m_videoMaterial;
 	CYUVTextureRegenerator<YUVCHANNEL_Y> *m_yTextureRegen;
 	CYUVTextureRegenerator<YUVCHANNEL_CB> *m_cbTextureRegen;
@@ -190,20 +212,88 @@ private:
 	bool m_videoEnded;
 
 	char m_videoPath[MAX_PATH];
+	char m_materialName[MAX_PATH];
+	char m_pathID[MAX_PATH];
+	bool m_bHasPathID;
+	void *m_pSoundDevice;
+	VideoDecodePriority_t m_priority;
+
+	// reads the file and decodes the sound on its own thread, so the sound stays topped up however
+	// often we're updated. It holds m_feedMutex while it works, anything else touching the demuxer,
+	// the sound or what the thread reads into has to hold it too. What it shares with every update,
+	// the clock, the loop's passes, the end of reading and what's been handed to the device, is only
+	// under m_feedStateMutex, which it takes just long enough to change them. Take it second
+	ThreadHandle_t m_hFeedThread;
+	CThreadMutex m_feedMutex;
+	CThreadMutex m_feedStateMutex;
+	CThreadEvent m_feedEvent;
+	volatile bool m_bFeedExit;
+	volatile unsigned int m_nFeedTicks; // when the feed thread last ran
+	double m_feedClock; // our clock as of the last update
+	bool m_bReadEnded; // nothing left to read and not looping
+
+	// an async load runs OpenVideo and DecodeFirstFrame, nothing else touches what they set up until
+	// m_nLoadState says it's done. m_bLoadSucceeded is written before that and only read after
+	enum
+	{
+		LOAD_RUNNING,
+		LOAD_DONE,
+		LOAD_ABANDONED, // destroyed while loading, the load thread deletes the material
+	};
+	ThreadHandle_t m_hLoadThread;
+	CInterlockedInt m_nLoadState;
+	bool m_bLoadSucceeded;
+	static CInterlockedInt s_nAbandonedLoads;
+	bool m_bFirstImageHeld; // m_image retained from the decoder until it's uploaded
+
+	// while following, the owner decodes and we just show its textures
+	CVideoMaterial *m_pShareOwner;
+	CUtlVector< CVideoMaterial * > m_shareFollowers;
+	// the owner is only updated by a follower if nobody has since the follower last looked
+	unsigned int m_nUpdates;
+	unsigned int m_nOwnerUpdatesSeen;
+	bool m_bLastUpdate;
 
 	float m_volume;
 	double m_curTime;
 	double m_videoTime;
 
-	unsigned int m_prevTicks;
+	// looping reads straight on into the start again, each pass's times carry on from the last one's
+	double m_loopPeriod; // length of a pass, worked out the first time we loop
+	double m_passOffset; // added to everything read in the pass being read
+	double m_shownPassStart; // where the pass the clock is in starts
+	// what's been read of the pass being read, from its start. -1 until something has
+	double m_passVideoEnd; // last frame
+	double m_passAudioStart; // last sound, and roughly where it ends going by the one before it
+	double m_passAudioEnd;
+	bool m_bAudioPassStart; // the next sound buffered starts a pass and is lined up with the end of the last
+
+	double m_prevTime;
+
+	// the clock follows the sound the device has actually played whenever there is any
+	double m_audioEndTime; // time of the end of the last sound buffered, -1 if none since the last flush
+	double m_avOffsetTotal; // shown frame's time less the sound's, for the report when the sound stops
+	double m_avOffsetWorst;
+	int m_nAVOffsets;
 	unsigned int m_currentFrame;
-	CUtlQueue< WebMFrame*> m_videoFrames;
+	CVideoDecodeStream *m_pDecodeStream;
 
 #ifdef _LINUX
 	SDL_AudioSpec* m_pAudioDevice;
 	Uint8* m_pAudioBuffer;
 
+	// the stream converts to the device format on the game thread, the ring hands that to the callback
 	SDL_AudioStream *m_pSDLAudioStream;
+	CVideoAudioRing m_audioRing;
+	bool m_bAudioRingFull;
+	int m_nAudioOverruns; // times the ring filled up with sound still waiting to go in
+	bool m_bAudioStarved; // only touched by the callback
+	volatile double m_flAudioReadTime; // when the callback last took sound from the ring
+	CInterlockedInt m_nAudioUnderruns; // times the callback ran out of sound
+	// the callback only touches the ring and m_pAudioBuffer while this is set, it's
+	// cleared with m_nAudioReaders waited out before either is set up or torn down
+	CInterlockedInt m_nAudioRingReady;
+	CInterlockedInt m_nAudioReaders; // callbacks between checking m_nAudioRingReady and being done
 #elif _WIN32
 	IDirectSound* m_pAudioDevice;
 	IDirectSoundBuffer* m_pAudioBuffer;
@@ -217,7 +307,8 @@ private:
 #endif
 
 	bool m_soundKilled;
-	short* m_pcm;
+	unsigned char* m_pcm; // a packet's worth of decoded sound, room for it as float
+	bool m_bFloatPCM; // decoded as float because that's what the device mixes in, otherwise S16
 	int m_nAudioBufferWriteOffset;
 	int m_nAudioBufferReadOffset;
 	int m_nAudioBufferFilledSize;
@@ -0,0 +1,711 @@
+//===========================================================================//
+//
+// Purpose: Readers that feed webm data to mkvparser
+//
+//===========================================================================//
+
+#include "video_reader.h"
+#include "tier0/platform.h"
+#include "tier0/dbg.h"
+#include "tier1/strtools.h"
+#include "filesystem.h"
+#include <limits.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#elif _LINUX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+// the prefetcher warms at most this much at a time so cancelling never waits long
+#define PREFETCH_CHUNK_SIZE ( 256 * 1024 )
+
+CVideoPrefetcher g_VideoPrefetcher;
+
+//=============================================================================
+//
+// Stdio reader
+//
+//=============================================================================
+void MkvReader::Warm( long long pos, long long len )
+{
+	if ( !m_warmFile )
+		m_warmFile = fopen( m_filePath, "rb" );
+	if ( !m_warmFile )
+		return;
+
+	static unsigned char s_scratch[ 64 * 1024 ];
+	fseek( m_warmFile, pos, SEEK_SET );
+	while ( len > 0 )
+	{
+		const size_t toRead = ( size_t )min( len, ( long long )sizeof( s_scratch ) );
+		const size_t read = fread( s_scratch, 1, toRead, m_warmFile );
+		if ( read < toRead )
+			break;
+		len -= read;
+	}
+}
+
+// how much of the start of the file to ask for up front, the headers and first few clusters live here
+#define MAPPED_READER_INITIAL_WILLNEED ( 4 * 1024 * 1024 )
+
+//=============================================================================
+//
+// Memory mapped reader
+//
+//=============================================================================
+CMappedMkvReader::CMappedMkvReader( const char *filePath )
+{
+	m_data = nullptr;
+	m_size = 0;
+
+#ifdef _WIN32
+	m_hFile = nullptr;
+	m_hMapping = nullptr;
+
+	HANDLE hFile = CreateFileA( filePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	if ( hFile == INVALID_HANDLE_VALUE )
+		return;
+	m_hFile = hFile;
+
+	LARGE_INTEGER fileSize;
+	if ( !GetFileSizeEx( hFile, &fileSize ) || fileSize.QuadPart <= 0 || fileSize.QuadPart > MAPPED_READER_MAX_SIZE )
+		return;
+
+	HANDLE hMapping = CreateFileMappingA( hFile, NULL, PAGE_READONLY, 0, 0, NULL );
+	if ( !hMapping )
+		return;
+	m_hMapping = hMapping;
+
+	// this can still fail on a 32-bit process with fragmented address space, we'll just fall back to stdio
+	m_data = ( unsigned char * )MapViewOfFile( hMapping, FILE_MAP_READ, 0, 0, 0 );
+	if ( m_data )
+		m_size = fileSize.QuadPart;
+#elif _LINUX
+	int fd = open( filePath, O_RDONLY );
+	if ( fd < 0 )
+		return;
+
+	struct stat st;
+	if ( fstat( fd, &st ) != 0 || st.st_size <= 0 || st.st_size > MAPPED_READER_MAX_SIZE )
+	{
+		close( fd );
+		return;
+	}
+
+	void *data = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	// the mapping keeps its own reference to the file
+	close( fd );
+	if ( data == MAP_FAILED )
+		return;
+
+	m_data = ( unsigned char * )data;
+	m_size = st.st_size;
+
+	// playback reads the file front to back, so let the kernel read ahead aggressively
+	// and drop pages behind us
+	madvise( m_data, m_size, MADV_SEQUENTIAL );
+#endif
+
+	ReadAhead( 0, MAPPED_READER_INITIAL_WILLNEED );
+}
+
+CMappedMkvReader::~CMappedMkvReader()
+{
+#ifdef _WIN32
+	if ( m_data )
+		UnmapViewOfFile( m_data );
+	if ( m_hMapping )
+		CloseHandle( ( HANDLE )m_hMapping );
+	if ( m_hFile )
+		CloseHandle( ( HANDLE )m_hFile );
+#elif _LINUX
+	if ( m_data )
+		munmap( m_data, m_size );
+#endif
+}
+
+int CMappedMkvReader::Read( long long pos, long len, unsigned char *buf )
+{
+	if ( !m_data || pos < 0 || len < 0 )
+		return -1;
+
+	if ( pos > m_size || len > m_size - pos )
+		return -1;
+
+	Q_memcpy( buf, m_data + pos, len );
+	return 0;
+}
+
+const unsigned char *CMappedMkvReader::GetStablePointer( long long pos, long len )
+{
+	if ( !m_data || pos < 0 || len < 0 )
+		return nullptr;
+
+	if ( pos > m_size || len > m_size - pos )
+		return nullptr;
+
+	return m_data + pos;
+}
+
+int CMappedMkvReader::Length( long long *total, long long *available )
+{
+	if ( !m_data )
+		return -1;
+	if ( total )
+		*total = m_size;
+	if ( available )
+		*available = m_size;
+	return 0;
+}
+
+void CMappedMkvReader::ReadAhead( long long pos, long long len )
+{
+	if ( !m_data || pos < 0 || pos >= m_size || len <= 0 )
+		return;
+
+	if ( len > m_size - pos )
+		len = m_size - pos;
+
+#ifdef _LINUX
+	// madvise wants a page aligned address
+	const long long pageSize = sysconf( _SC_PAGESIZE );
+	const long long alignedPos = pos - ( pos % pageSize );
+	madvise( m_data + alignedPos, len + ( pos - alignedPos ), MADV_WILLNEED );
+#elif _WIN32
+	// PrefetchVirtualMemory is Windows 8+, so look it up rather than link against it
+	typedef struct
+	{
+		PVOID VirtualAddress;
+		SIZE_T NumberOfBytes;
+	} PrefetchRange_t;
+	typedef BOOL ( WINAPI *PrefetchVirtualMemoryFn )( HANDLE, ULONG_PTR, PrefetchRange_t *, ULONG );
+	static PrefetchVirtualMemoryFn s_pfnPrefetchVirtualMemory = ( PrefetchVirtualMemoryFn )GetProcAddress( GetModuleHandleA( "kernel32.dll" ), "PrefetchVirtualMemory" );
+	if ( s_pfnPrefetchVirtualMemory )
+	{
+		PrefetchRange_t range;
+		range.VirtualAddress = m_data + pos;
+		range.NumberOfBytes = ( SIZE_T )len;
+		s_pfnPrefetchVirtualMemory( GetCurrentProcess(), 1, &range, 0 );
+	}
+#endif
+}
+
+void CMappedMkvReader::Warm( long long pos, long long len )
+{
+	if ( !m_data || pos < 0 || pos >= m_size || len <= 0 )
+		return;
+
+	if ( len > m_size - pos )
+		len = m_size - pos;
+
+	// touching a byte in every page is enough to fault it in
+	volatile unsigned char sink = 0;
+	const long long end = pos + len;
+	for ( long long p = pos; p < end; p += 4096 )
+		sink ^= m_data[ p ];
+	sink ^= m_data[ end - 1 ];
+}
+
+//=============================================================================
+//
+// Engine filesystem
+//
+//=============================================================================
+class CEngineVideoFileSystem : public IVideoFileSystem
+{
+public:
+	bool GetLoosePath( const char *pFileName, const char *pPathID, char *pFullPath, int nMaxLen )
+	{
+		return g_pFullFileSystem->RelativePathToFullPath( pFileName, pPathID, pFullPath, nMaxLen, FILTER_CULLPACK ) != nullptr;
+	}
+
+	FileHandle_t Open( const char *pFileName, const char *pPathID )
+	{
+		return g_pFullFileSystem->Open( pFileName, "rb", pPathID );
+	}
+	void Close( FileHandle_t hFile )
+	{
+		g_pFullFileSystem->Close( hFile );
+	}
+	unsigned int Size( FileHandle_t hFile )
+	{
+		return g_pFullFileSystem->Size( hFile );
+	}
+	void Seek( FileHandle_t hFile, int pos )
+	{
+		g_pFullFileSystem->Seek( hFile, pos, FILESYSTEM_SEEK_HEAD );
+	}
+	int Read( void *pOutput, int size, FileHandle_t hFile )
+	{
+		return g_pFullFileSystem->Read( pOutput, size, hFile );
+	}
+
+	FSAsyncFile_t AsyncBeginRead( const char *pFileName, const char *pPathID )
+	{
+		return g_pFullFileSystem->AsyncBeginRead( pFileName, pPathID );
+	}
+	void AsyncEndRead( FSAsyncFile_t hAsyncFile )
+	{
+		g_pFullFileSystem->AsyncEndRead( hAsyncFile );
+	}
+	bool AsyncReadAndWait( const FileAsyncRequest_t &request )
+	{
+		FSAsyncControl_t hControl = nullptr;
+		if ( g_pFullFileSystem->AsyncRead( request, &hControl ) != FSASYNC_OK )
+			return false;
+
+		const FSAsyncStatus_t status = g_pFullFileSystem->AsyncFinish( hControl, true );
+		g_pFullFileSystem->AsyncRelease( hControl );
+		return status == FSASYNC_OK;
+	}
+};
+
+static CEngineVideoFileSystem s_EngineVideoFileSystem;
+
+IVideoFileSystem *GetEngineVideoFileSystem()
+{
+	return &s_EngineVideoFileSystem;
+}
+
+//=============================================================================
+//
+// Filesystem reader
+//
+//=============================================================================
+CFileSystemMkvReader::CFileSystemMkvReader( const char *pFileName, const char *pPathID, IVideoFileSystem *pFileSystem )
+{
+	m_pFileSystem = pFileSystem ? pFileSystem : GetEngineVideoFileSystem();
+	m_hFile = nullptr;
+	m_hAsyncFile = FS_INVALID_ASYNC_FILE;
+	m_length = 0;
+	m_filePos = -1;
+	m_pWarmBuffer = nullptr;
+
+	Q_strncpy( m_fileName, pFileName, sizeof( m_fileName ) );
+	m_bHasPathID = pPathID != nullptr;
+	Q_strncpy( m_pathID, pPathID ? pPathID : "", sizeof( m_pathID ) );
+
+	m_hFile = m_pFileSystem->Open( m_fileName, m_bHasPathID ? m_pathID : nullptr );
+	if ( !m_hFile )
+		return;
+
+	m_length = m_pFileSystem->Size( m_hFile );
+	m_filePos = 0;
+
+	// keeps the file open for the async reads rather than opening it for each one
+	m_hAsyncFile = m_pFileSystem->AsyncBeginRead( m_fileName, m_bHasPathID ? m_pathID : nullptr );
+}
+
+CFileSystemMkvReader::~CFileSystemMkvReader()
+{
+	if ( m_hAsyncFile != FS_INVALID_ASYNC_FILE )
+		m_pFileSystem->AsyncEndRead( m_hAsyncFile );
+	if ( m_hFile )
+		m_pFileSystem->Close( m_hFile );
+	delete[] m_pWarmBuffer;
+}
+
+int CFileSystemMkvReader::Read( long long pos, long len, unsigned char *buf )
+{
+	if ( !m_hFile || pos < 0 || len < 0 )
+		return -1;
+
+	if ( pos > m_length || len > m_length - pos )
+		return -1;
+
+	// IFileSystem only seeks with an int
+	if ( pos + len > INT_MAX )
+		return -1;
+
+	if ( pos != m_filePos )
+		m_pFileSystem->Seek( m_hFile, ( int )pos );
+
+	if ( m_pFileSystem->Read( buf, len, m_hFile ) != len )
+	{
+		// no idea where the handle ended up
+		m_filePos = -1;
+		return -1;
+	}
+
+	m_filePos = pos + len;
+	return 0;
+}
+
+int CFileSystemMkvReader::Length( long long *total, long long *available )
+{
+	if ( !m_hFile )
+		return -1;
+	if ( total )
+		*total = m_length;
+	if ( available )
+		*available = m_length;
+	return 0;
+}
+
+void CFileSystemMkvReader::Warm( long long pos, long long len )
+{
+	if ( !m_hFile || pos < 0 || pos >= m_length || len <= 0 )
+		return;
+
+	if ( len > m_length - pos )
+		len = m_length - pos;
+
+	if ( pos + len > INT_MAX )
+		return;
+
+	if ( !m_pWarmBuffer )
+		m_pWarmBuffer = new unsigned char[ PREFETCH_CHUNK_SIZE ];
+
+	while ( len > 0 )
+	{
+		const int toRead = ( int )min( len, ( long long )PREFETCH_CHUNK_SIZE );
+
+		FileAsyncRequest_t request;
+		request.pszFilename = m_fileName;
+		request.pszPathID = m_bHasPathID ? m_pathID : nullptr;
+		request.hSpecificAsyncFile = m_hAsyncFile;
+		request.pData = m_pWarmBuffer;
+		request.nOffset = ( int )pos;
+		request.nBytes = toRead;
+		// behind anything the game actually needs
+		request.priority = -1;
+
+		if ( !m_pFileSystem->AsyncReadAndWait( request ) )
+			return;
+
+		pos += toRead;
+		len -= toRead;
+	}
+}
+
+//=============================================================================
+//
+// Page cached reader
+//
+//=============================================================================
+CCachedMkvReader::CCachedMkvReader( CVideoReader *pReader, int nPages )
+{
+	m_pReader = pReader;
+	m_length = -1;
+
+	// read ahead only ever fills half the cache, so we need at least a couple of pages
+	m_nPages = max( nPages, 2 );
+	m_pPages = new CachePage_t[ m_nPages ];
+	m_pPageData = new unsigned char[ m_nPages * CACHED_READER_PAGE_SIZE ];
+	for ( int i = 0; i < m_nPages; ++i )
+	{
+		m_pPages[ i ].index = -1;
+		m_pPages[ i ].len = 0;
+		m_pPages[ i ].lastUsed = 0;
+		m_pPages[ i ].data = m_pPageData + ( i * CACHED_READER_PAGE_SIZE );
+	}
+	m_nUseCounter = 0;
+
+	m_readAheadStart = 0;
+	m_readAheadEnd = 0;
+
+	m_nHits = 0;
+	m_nMisses = 0;
+
+	// stdio's Length seeks about, and mkvparser asks a lot, so just ask once
+	long long total = 0;
+	if ( m_pReader && m_pReader->Length( &total, nullptr ) == 0 )
+		m_length = total;
+}
+
+CCachedMkvReader::~CCachedMkvReader()
+{
+	if ( m_nHits + m_nMisses )
+		DevMsg( "Video read cache: %u hits, %u misses (%.1f%% hit rate)\n", m_nHits, m_nMisses, 100.0 * m_nHits / ( m_nHits + m_nMisses ) );
+
+	delete[] m_pPageData;
+	delete[] m_pPages;
+	delete m_pReader;
+}
+
+int CCachedMkvReader::Read( long long pos, long len, unsigned char *buf )
+{
+	if ( !IsOpen() || pos < 0 || len < 0 )
+		return -1;
+
+	// couldn't get a length, so we can't tell where the last page ends
+	if ( m_length < 0 )
+		return m_pReader->Read( pos, len, buf );
+
+	if ( pos > m_length || len > m_length - pos )
+		return -1;
+
+	// something this big would just flush out everything else
+	if ( len > ( m_nPages / 2 ) * CACHED_READER_PAGE_SIZE )
+		return m_pReader->Read( pos, len, buf );
+
+	while ( len > 0 )
+	{
+		CachePage_t *pPage = GetPage( pos / CACHED_READER_PAGE_SIZE );
+		if ( !pPage )
+			return -1;
+
+		const long offset = pos - ( pPage->index * CACHED_READER_PAGE_SIZE );
+		const long toCopy = min( len, pPage->len - offset );
+		if ( toCopy <= 0 )
+			return -1;
+
+		Q_memcpy( buf, pPage->data + offset, toCopy );
+		buf += toCopy;
+		pos += toCopy;
+		len -= toCopy;
+	}
+	return 0;
+}
+
+int CCachedMkvReader::Length( long long *total, long long *available )
+{
+	if ( !IsOpen() )
+		return -1;
+	if ( m_length < 0 )
+		return m_pReader->Length( total, available );
+
+	if ( total )
+		*total = m_length;
+	if ( available )
+		*available = m_length;
+	return 0;
+}
+
+void CCachedMkvReader::ReadAhead( long long pos, long long len )
+{
+	if ( pos < 0 || len <= 0 )
+		return;
+
+	m_readAheadStart = pos;
+	m_readAheadEnd = pos + len;
+}
+
+CCachedMkvReader::CachePage_t *CCachedMkvReader::GetPage( long long index )
+{
+	CachePage_t *pPage = FindPage( index );
+	if ( pPage )
+	{
+		++m_nHits;
+		pPage->lastUsed = ++m_nUseCounter;
+		return pPage;
+	}
+
+	++m_nMisses;
+	pPage = LoadPage( index );
+	if ( !pPage )
+		return nullptr;
+
+	// if we're inside the range we were told about, grab the pages after this one while we're at it
+	const long long pos = index * CACHED_READER_PAGE_SIZE;
+	if ( pos >= m_readAheadStart && pos < m_readAheadEnd )
+	{
+		const long long lastIndex = min( ( m_readAheadEnd - 1 ) / CACHED_READER_PAGE_SIZE, index + ( m_nPages / 2 ) - 1 );
+		for ( long long i = index + 1; i <= lastIndex; ++i )
+		{
+			if ( FindPage( i ) )
+				continue;
+			if ( !LoadPage( i ) )
+				break;
+		}
+	}
+
+	// loading the read ahead pages won't have evicted this one, it's the most recently used
+	return pPage;
+}
+
+CCachedMkvReader::CachePage_t *CCachedMkvReader::FindPage( long long index )
+{
+	for ( int i = 0; i < m_nPages; ++i )
+	{
+		if ( m_pPages[ i ].index == index )
+			return &m_pPages[ i ];
+	}
+	return nullptr;
+}
+
+CCachedMkvReader::CachePage_t *CCachedMkvReader::LoadPage( long long index )
+{
+	const long long pos = index * CACHED_READER_PAGE_SIZE;
+	if ( pos >= m_length )
+		return nullptr;
+
+	// evict whatever was used longest ago
+	CachePage_t *pPage = &m_pPages[ 0 ];
+	for ( int i = 1; i < m_nPages; ++i )
+	{
+		if ( m_pPages[ i ].lastUsed < pPage->lastUsed )
+			pPage = &m_pPages[ i ];
+	}
+
+	const int len = ( int )min( ( long long )CACHED_READER_PAGE_SIZE, m_length - pos );
+	if ( m_pReader->Read( pos, len, pPage->data ) != 0 )
+	{
+		pPage->index = -1;
+		pPage->lastUsed = 0;
+		return nullptr;
+	}
+
+	pPage->index = index;
+	pPage->len = len;
+	pPage->lastUsed = ++m_nUseCounter;
+	return pPage;
+}
+
+//=============================================================================
+//
+// Prefetch thread
+//
+//=============================================================================
+CVideoPrefetcher::CVideoPrefetcher()
+{
+	m_pActiveReader = nullptr;
+	m_hThread = nullptr;
+	m_bExit = false;
+}
+
+void CVideoPrefetcher::Queue( CVideoReader *pReader, long long pos, long long len )
+{
+	if ( !pReader || pos < 0 || len <= 0 )
+		return;
+
+	m_mutex.Lock();
+	if ( !m_hThread )
+	{
+		m_bExit = false;
+		m_hThread = CreateSimpleThread( ThreadFunc, this );
+	}
+
+	PrefetchRequest_t request;
+	request.pReader = pReader;
+	request.pos = pos;
+	request.len = len;
+	m_requests.Insert( request );
+	m_mutex.Unlock();
+
+	m_workEvent.Set();
+}
+
+void CVideoPrefetcher::Cancel( CVideoReader *pReader )
+{
+	m_mutex.Lock();
+	// rebuild the queue without the reader's requests
+	const int count = m_requests.Count();
+	for ( int i = 0; i < count; ++i )
+	{
+		PrefetchRequest_t request = m_requests.RemoveAtHead();
+		if ( request.pReader != pReader )
+			m_requests.Insert( request );
+	}
+
+	// requests are worked through a chunk at a time, so this won't be long
+	while ( m_pActiveReader == pReader )
+	{
+		m_mutex.Unlock();
+		ThreadSleep( 1 );
+		m_mutex.Lock();
+	}
+	m_mutex.Unlock();
+}
+
+void CVideoPrefetcher::Shutdown()
+{
+	if ( !m_hThread )
+		return;
+
+	m_mutex.Lock();
+	m_bExit = true;
+	m_requests.RemoveAll();
+	m_mutex.Unlock();
+
+	m_workEvent.Set();
+	ThreadJoin( m_hThread );
+	ReleaseThreadHandle( m_hThread );
+	m_hThread = nullptr;
+}
+
+unsigned int CVideoPrefetcher::ThreadFunc( void *params )
+{
+	( ( CVideoPrefetcher * )params )->Run();
+	return 0;
+}
+
+void CVideoPrefetcher::Run()
+{
+	while ( true )
+	{
+		m_workEvent.Wait();
+
+		while ( true )
+		{
+			m_mutex.Lock();
+			if ( m_bExit )
+			{
+				m_mutex.Unlock();
+				return;
+			}
+			if ( m_requests.Count() == 0 )
+			{
+				m_mutex.Unlock();
+				break;
+			}
+
+			// take a chunk off the front of the oldest request
+			PrefetchRequest_t &front = m_requests.Head();
+			PrefetchRequest_t chunk = front;
+			chunk.len = min( front.len, ( long long )PREFETCH_CHUNK_SIZE );
+			front.pos += chunk.len;
+			front.len -= chunk.len;
+			if ( front.len <= 0 )
+				m_requests.RemoveAtHead();
+
+			m_pActiveReader = chunk.pReader;
+			m_mutex.Unlock();
+
+			chunk.pReader->Warm( chunk.pos, chunk.len );
+
+			m_mutex.Lock();
+			m_pActiveReader = nullptr;
+			m_mutex.Unlock();
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Picks the best reader we can get for the file
+//-----------------------------------------------------------------------------
+CVideoReader *CreateVideoReader( const char *pFileName, const char *pPathID, IVideoFileSystem *pFileSystem )
+{
+	if ( !pFileSystem )
+		pFileSystem = GetEngineVideoFileSystem();
+
+	// only get a path for loose files, packed ones have to go through the filesystem
+	char fullPath[ MAX_PATH ];
+	if ( pFileSystem->GetLoosePath( pFileName, pPathID, fullPath, sizeof( fullPath ) ) )
+	{
+		CVideoReader *pReader = new CMappedMkvReader( fullPath );
+		if ( pReader->IsOpen() )
+			return pReader;
+		delete pReader;
+
+		DevMsg( "Couldn't map %s, falling back to cached file reads\n", fullPath );
+		pReader = new CCachedMkvReader( new MkvReader( fullPath ) );
+		if ( pReader->IsOpen() )
+			return pReader;
+		delete pReader;
+	}
+
+	CVideoReader *pReader = new CCachedMkvReader( new CFileSystemMkvReader( pFileName, pPathID, pFileSystem ) );
+	if ( pReader->IsOpen() )
+		return pReader;
+	delete pReader;
+
+	return nullptr;
+}
@@ -0,0 +1,311 @@
+#ifndef VIDEO_READER_H
+#define VIDEO_READER_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include <stdio.h>
+#include <mkvparser/mkvparser.h>
+#include "tier0/platform.h"
+#include "tier0/threadtools.h"
+#include "tier1/utlqueue.h"
+#include "filesystem.h"
+
+//-----------------------------------------------------------------------------
+// Purpose: Base for the readers mkvparser pulls the webm from.
+//			IMkvReader's destructor is protected so this gives us one we can delete through
+//-----------------------------------------------------------------------------
+class CVideoReader : public mkvparser::IMkvReader
+{
+public:
+	virtual ~CVideoReader() {}
+
+	virtual bool IsOpen() const = 0;
+
+	// Pointer to len bytes at pos that stays valid for the life of the reader, or nullptr if
+	// the data can only be copied out with Read
+	virtual const unsigned char *GetStablePointer( long long pos, long len )
+	{
+		return nullptr;
+	}
+
+	// Hint that [pos, pos + len) is about to be read, e.g. the cluster the demuxer just entered
+	virtual void ReadAhead( long long pos, long long len ) {}
+
+	// Called from the prefetch thread. Pull [pos, pos + len) into memory (ours or the OS's) so the
+	// reads that come later don't touch the disk. Must not disturb anything Read relies on
+	virtual void Warm( long long pos, long long len ) {}
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Plain stdio reader, a seek and a read for every request
+//-----------------------------------------------------------------------------
+class MkvReader : public CVideoReader
+{
+public:
+	MkvReader( const char *filePath ) :
+		m_file( fopen( filePath, "rb" ) ),
+		m_warmFile( nullptr )
+	{
+		Q_strncpy( m_filePath, filePath, sizeof( m_filePath ) );
+	}
+	~MkvReader()
+	{
+		if ( m_file )
+			fclose( m_file );
+		if ( m_warmFile )
+			fclose( m_warmFile );
+	}
+
+	bool IsOpen() const
+	{
+		return m_file != nullptr;
+	}
+
+	int Read( long long pos, long len, unsigned char *buf )
+	{
+		if ( !m_file )
+			return -1;
+		fseek( m_file, pos, SEEK_SET );
+		const size_t size = fread( buf, 1, len, m_file );
+		if ( size < size_t( len ) )
+			return -1;
+		return 0;
+	}
+	int Length( long long *total, long long *available )
+	{
+		if ( !m_file )
+			return -1;
+		const long pos = ftell( m_file );
+		fseek( m_file, 0, SEEK_END );
+		if ( total )
+			*total = ftell( m_file );
+		if ( available )
+			*available = ftell( m_file );
+		fseek( m_file, pos, SEEK_SET );
+		return 0;
+	}
+
+	// Reads through a second handle so the OS has it cached when Read gets there
+	void Warm( long long pos, long long len );
+
+private:
+	FILE *m_file;
+	FILE *m_warmFile; // only ever touched by the prefetch thread
+	char m_filePath[MAX_PATH];
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Maps the whole file into memory so every read is just a memcpy. The
+//			mapping takes up address space for the whole file, which a 32-bit process
+//			has little of, so anything over MAPPED_READER_MAX_SIZE isn't mapped
+//-----------------------------------------------------------------------------
+#define MAPPED_READER_MAX_SIZE ( 256LL * 1024 * 1024 )
+
+class CMappedMkvReader : public CVideoReader
+{
+public:
+	CMappedMkvReader( const char *filePath );
+	~CMappedMkvReader();
+
+	bool IsOpen() const
+	{
+		return m_data != nullptr;
+	}
+
+	int Read( long long pos, long len, unsigned char *buf );
+	int Length( long long *total, long long *available );
+
+	// Everything is already in memory so packets can be decoded straight from the mapping
+	const unsigned char *GetStablePointer( long long pos, long len );
+
+	// Ask the OS to start paging in a range we're about to read
+	void ReadAhead( long long pos, long long len );
+	// Fault the pages in ourselves so the main thread never waits on them
+	void Warm( long long pos, long long len );
+
+private:
+	unsigned char *m_data;
+	long long m_size;
+
+#ifdef _WIN32
+	void *m_hFile;
+	void *m_hMapping;
+#endif
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: The handful of filesystem calls the readers make. Normally the engine's
+//			filesystem is behind it, but anything can stand in for it, like an
+//			in-memory one that never touches the disk
+//-----------------------------------------------------------------------------
+class IVideoFileSystem
+{
+public:
+	virtual ~IVideoFileSystem() {}
+
+	// Full path of a loose file the OS can open itself, false for anything packed
+	virtual bool GetLoosePath( const char *pFileName, const char *pPathID, char *pFullPath, int nMaxLen ) = 0;
+
+	virtual FileHandle_t Open( const char *pFileName, const char *pPathID ) = 0;
+	virtual void Close( FileHandle_t hFile ) = 0;
+	virtual unsigned int Size( FileHandle_t hFile ) = 0;
+	virtual void Seek( FileHandle_t hFile, int pos ) = 0;
+	virtual int Read( void *pOutput, int size, FileHandle_t hFile ) = 0;
+
+	// Keeps the file open for async reads, FS_INVALID_ASYNC_FILE if it can't
+	virtual FSAsyncFile_t AsyncBeginRead( const char *pFileName, const char *pPathID ) = 0;
+	virtual void AsyncEndRead( FSAsyncFile_t hAsyncFile ) = 0;
+	// Queues the read with the rest of the async reads and waits for it
+	virtual bool AsyncReadAndWait( const FileAsyncRequest_t &request ) = 0;
+};
+
+// Goes to g_pFullFileSystem
+IVideoFileSystem *GetEngineVideoFileSystem();
+
+//-----------------------------------------------------------------------------
+// Purpose: Reads through the engine's filesystem, so videos can be packed in VPKs
+//			and go through the engine's own I/O
+//-----------------------------------------------------------------------------
+class CFileSystemMkvReader : public CVideoReader
+{
+public:
+	// pFileSystem defaults to the engine's
+	CFileSystemMkvReader( const char *pFileName, const char *pPathID, IVideoFileSystem *pFileSystem = nullptr );
+	~CFileSystemMkvReader();
+
+	bool IsOpen() const
+	{
+		return m_hFile != nullptr;
+	}
+
+	int Read( long long pos, long len, unsigned char *buf );
+	int Length( long long *total, long long *available );
+
+	// Goes through the filesystem's async queue so it's scheduled with the rest of the engine's reads
+	void Warm( long long pos, long long len );
+
+private:
+	IVideoFileSystem *m_pFileSystem;
+	FileHandle_t m_hFile;
+	FSAsyncFile_t m_hAsyncFile;
+	long long m_length;
+	long long m_filePos; // where the handle is, so back to back reads don't seek
+
+	char m_fileName[MAX_PATH];
+	char m_pathID[MAX_PATH];
+	bool m_bHasPathID;
+
+	unsigned char *m_pWarmBuffer; // only ever touched by the prefetch thread
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: LRU page cache in front of another reader. mkvparser does lots of tiny
+//			reads close together, this turns them into a few page sized reads
+//-----------------------------------------------------------------------------
+#define CACHED_READER_PAGE_SIZE ( 64 * 1024 )
+#define CACHED_READER_DEFAULT_PAGES 64
+
+class CCachedMkvReader : public CVideoReader
+{
+public:
+	// takes ownership of pReader
+	CCachedMkvReader( CVideoReader *pReader, int nPages = CACHED_READER_DEFAULT_PAGES );
+	~CCachedMkvReader();
+
+	bool IsOpen() const
+	{
+		return m_pReader && m_pReader->IsOpen();
+	}
+
+	int Read( long long pos, long len, unsigned char *buf );
+	int Length( long long *total, long long *available );
+
+	// Misses inside this range pull in the rest of it, up to half the cache
+	void ReadAhead( long long pos, long long len );
+	// The page cache isn't thread safe, so this just warms the OS cache through the wrapped reader
+	void Warm( long long pos, long long len )
+	{
+		if ( m_pReader )
+			m_pReader->Warm( pos, len );
+	}
+
+	unsigned int GetHits() const
+	{
+		return m_nHits;
+	}
+	unsigned int GetMisses() const
+	{
+		return m_nMisses;
+	}
+
+private:
+	struct CachePage_t
+	{
+		long long index; // page number in the file, -1 when unused
+		int len;
+		unsigned int lastUsed;
+		unsigned char *data;
+	};
+
+	CachePage_t *GetPage( long long index );
+	CachePage_t *FindPage( long long index );
+	CachePage_t *LoadPage( long long index );
+
+	CVideoReader *m_pReader;
+	long long m_length;
+
+	CachePage_t *m_pPages;
+	unsigned char *m_pPageData;
+	int m_nPages;
+	unsigned int m_nUseCounter;
+
+	long long m_readAheadStart;
+	long long m_readAheadEnd;
+
+	unsigned int m_nHits;
+	unsigned int m_nMisses;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: One thread shared by every video that warms byte ranges ahead of the
+//			demuxer, so disk stalls land on it rather than the game thread
+//-----------------------------------------------------------------------------
+class CVideoPrefetcher
+{
+public:
+	CVideoPrefetcher();
+
+	// The thread starts on the first request
+	void Queue( CVideoReader *pReader, long long pos, long long len );
+	// Drops anything queued for the reader and waits out a request in progress. Call before deleting it
+	void Cancel( CVideoReader *pReader );
+	void Shutdown();
+
+private:
+	static unsigned int ThreadFunc( void *params );
+	void Run();
+
+	struct PrefetchRequest_t
+	{
+		CVideoReader *pReader;
+		long long pos;
+		long long len;
+	};
+
+	CUtlQueue< PrefetchRequest_t > m_requests;
+	CThreadMutex m_mutex;
+	CThreadEvent m_workEvent;
+	CVideoReader *m_pActiveReader;
+	ThreadHandle_t m_hThread;
+	volatile bool m_bExit;
+};
+
+extern CVideoPrefetcher g_VideoPrefetcher;
+
+// Loose files get mapped (or stdio if that fails or they're too big to map), anything the OS can't see directly, like VPK contents,
+// is read through the filesystem. pFileSystem defaults to the engine's. Returns nullptr if the file
+// can't be opened at all
+CVideoReader *CreateVideoReader( const char *pFileName, const char *pPathID, IVideoFileSystem *pFileSystem = nullptr );
+
+#endif
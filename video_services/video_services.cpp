@@ -64,6 +64,10 @@ bool CVideoServices::Connect( CreateInterfaceFn factory )
 // --------------------------------------------------------------------
 void CVideoServices::Disconnect()
 {
+	CVideoMaterial::WaitForAbandonedLoads();
+	g_VideoDecodePool.Shutdown();
+	g_VideoDecoderCache.Purge();
+	g_VideoPrefetcher.Shutdown();
 	BaseClass::Disconnect();
 }
 
@@ -93,6 +97,10 @@ InitReturnVal_t	CVideoServices::Init()
 // --------------------------------------------------------------------
 void CVideoServices::Shutdown()
 {
+	CVideoMaterial::WaitForAbandonedLoads();
+	g_VideoDecodePool.Shutdown();
+	g_VideoDecoderCache.Purge();
+	g_VideoPrefetcher.Shutdown();
 	BaseClass::Shutdown();
 }
 
@@ -173,12 +181,24 @@ VideoResult_t CVideoServices::LocatePlayableVideoFile( const char *pSearchFileNa
 	if ( !g_pFullFileSystem->FileExists( pSearchFileName, pPathID ) )
 		return VideoResult_t::VIDEO_FILE_NOT_FOUND;
 
-	g_pFullFileSystem->RelativePathToFullPath( pSearchFileName, pPathID, pPlaybackFileName, fileNameMaxLen );
+	// hand back the relative name, the file may well be inside a VPK so a full path means nothing
+	if ( pPlaybackFileName )
+		Q_strncpy( pPlaybackFileName, pSearchFileName, fileNameMaxLen );
 	return VideoResult_t::SUCCESS;
 }
 
 IVideoMaterial *CVideoServices::CreateVideoMaterial( const char *pMaterialName, const char *pVideoFileName, const char *pPathID,
 	VideoPlaybackFlags_t playbackFlags, VideoSystem_t videoSystem, bool PlayAlternateIfNotAvailable )
+{
+	const bool bAsync = ( playbackFlags & VIDEO_PLAYBACK_ASYNC_LOAD ) != 0;
+	return CreateVideoMaterial( pMaterialName, pVideoFileName, pPathID, VIDEO_DECODE_PRIORITY_WORLD, bAsync );
+}
+
+// --------------------------------------------------------------------
+// Purpose: Fullscreen playback gets first call on the decode threads.
+//			Async loads don't even look for the file here, opening it fails on the load thread if it's missing
+// --------------------------------------------------------------------
+CVideoMaterial *CVideoServices::CreateVideoMaterial( const char *pMaterialName, const char *pVideoFileName, const char *pPathID, VideoDecodePriority_t priority, bool bAsync )
 {
 	char sVideoPath[MAX_PATH];
 	char sVideoFilename[MAX_PATH];
@@ -188,11 +208,32 @@ IVideoMaterial *CVideoServices::CreateVideoMaterial( const char *pMaterialName,
 	Q_SetExtension( sVideoFilename, "webm", sizeof( sVideoFilename ) );
 
 	// find playable file
-	if ( LocatePlayableVideoFile( sVideoFilename, pPathID, nullptr, sVideoPath, MAX_PATH ) != VideoResult_t::SUCCESS )
+	if ( bAsync )
+	{
+		if ( LocateVideoSystemForPlayingFile( sVideoFilename ) == VideoSystem_t::NONE )
+			return nullptr;
+		Q_strncpy( sVideoPath, sVideoFilename, sizeof( sVideoPath ) );
+	}
+	else if ( LocatePlayableVideoFile( sVideoFilename, pPathID, nullptr, sVideoPath, MAX_PATH ) != VideoResult_t::SUCCESS )
 		return nullptr;
 
+	// a bank of screens showing the same file only needs it decoded once
+	if ( priority == VIDEO_DECODE_PRIORITY_WORLD )
+	{
+		FOR_EACH_VEC( m_vecVideos, i )
+		{
+			if ( !m_vecVideos[ i ]->CanShare( sVideoPath, pPathID ) )
+				continue;
+
+			CVideoMaterial *pMaterial = new CVideoMaterial();
+			pMaterial->ShareVideo( pMaterialName, m_vecVideos[ i ] );
+			m_vecVideos.AddToTail( pMaterial );
+			return pMaterial;
+		}
+	}
+
 	CVideoMaterial *pMaterial = new CVideoMaterial();
-	if ( !pMaterial->LoadVideo( pMaterialName, sVideoPath, m_pSoundDevice ) )
+	if ( !pMaterial->LoadVideo( pMaterialName, sVideoPath, pPathID, m_pSoundDevice, priority, bAsync ) )
 	{
 		delete pMaterial;
 		return nullptr;
@@ -208,7 +249,7 @@ VideoResult_t CVideoServices::DestroyVideoMaterial( IVideoMaterial *pVideoMateri
 	int idx = m_vecVideos.Find( pCVideoMaterial );
 	if ( idx != -1 )
 	{
-		delete pCVideoMaterial;
+		pCVideoMaterial->Destroy();
 		m_vecVideos.Remove( idx );
 		return VideoResult_t::SUCCESS;
 	}
@@ -236,8 +277,7 @@ VideoResult_t CVideoServices::PlayVideoFileFullScreen( const char *pFileName, co
 #endif
 
 	// TODO - do this properly so it can return a proper error
-	CVideoMaterial *videoMaterial = (CVideoMaterial *)CreateVideoMaterial( "FullScreenVideo", pFileName, pPathID, playbackFlags, 
-																			videoSystem, PlayAlternateIfNotAvailable );
+	CVideoMaterial *videoMaterial = CreateVideoMaterial( "FullScreenVideo", pFileName, pPathID, VIDEO_DECODE_PRIORITY_FULLSCREEN );
 	if ( !videoMaterial )
 	{
 #ifdef _WIN32
@@ -7,6 +7,7 @@
 #include "tier3/tier3.h"
 #include "video/ivideoservices.h"
 #include "utlvector.h"
+#include "video_decode_thread.h"
 #ifdef _WIN32
 #include <Windows.h>
 #include "dsound.h"
@@ -16,6 +17,10 @@
 
 class CVideoMaterial;
 
+// not one of the interface's playback flags, or it in to have CreateVideoMaterial hand back the material
+// straight away and open the file off the main thread. It isn't ready to play until IsVideoReadyToPlay says so
+#define VIDEO_PLAYBACK_ASYNC_LOAD 0x80000000
+
 //---------------------------------------------------------
 // Video Services
 //---------------------------------------------------------
@@ -97,6 +102,8 @@ public:
 	CUtlVector< CVideoMaterial*> m_vecVideos;
 
 private:
+	CVideoMaterial *CreateVideoMaterial( const char *pMaterialName, const char *pVideoFileName, const char *pPathID, VideoDecodePriority_t priority, bool bAsync = false );
+
 #ifdef _WIN32
 	IDirectSound *m_pSoundDevice;
 #elif _LINUX